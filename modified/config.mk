@@ -10,8 +10,8 @@ LIBS += -lpng -lm
 
 # Code!
 OBJECTS =\
-	DTDither.o DTImage.o DTPalette.o MCQuantization.o\
-	MedianPartition.o SplitImage.o XMalloc.o\
+	DTDither.o DTDotDiffusion.o DTImage.o DTOrdered.o DTPalette.o MCQuantization.o\
+	DTRiemersma.o MedianPartition.o SplitImage.o XMalloc.o\
 	main.o
 
 # Binary!
@@ -40,3 +40,6 @@ src/MedianPartition.o: CFLAGS += -Wno-cast-align -Wno-shadow -Wno-array-bounds-p
 src/MCQuantization.o: CFLAGS += -Wno-cast-align
 src/SplitImage.o: CFLAGS += -Wno-cast-align
 src/DTPalette.o: CFLAGS += -Wno-cast-align
+src/DTOrdered.o: CFLAGS += -Wno-cast-align
+src/DTRiemersma.o: CFLAGS += -Wno-cast-align
+src/DTDotDiffusion.o: CFLAGS += -Wno-cast-align
@@ -8,9 +8,12 @@
 
 #include <DTDither.h>
 #include <UtilMacro.h>
+#include <XMalloc.h>
+#include <DTPixelPack.h>
 
 #include <stdint.h>
 #include <immintrin.h>
+#include <sched.h>
 
 #include <stdio.h>
 #include <string.h>
@@ -46,7 +49,7 @@ static int16_t fsdither_kernel_scalar(int16_t diff_3, int16_t diff_2, int16_t di
  * 
  * 
  */
-static void fsdither_kernel_simd(int16_t *input, // Array A
+static inline __m256i fsdither_kernel_simd(int16_t *input, // Array A
                                 int16_t *palette, // Array B
                                 int16_t *output, // Array A
                                 int16_t *offset // Array A
@@ -146,131 +149,735 @@ static void fsdither_kernel_simd(int16_t *input, // Array A
         offset_output = _mm256_add_epi16(offset_output, original_offset);
         _mm256_store_si256((__m256i*) offset, offset_output);
     }
+
+    return diff_cols[0];
 }
 
 /**
- * 
+ * Diffuses error into one column of every channel (all three, or the single
+ * plane of a grey strip), then searches its 16 pixels against the palette
+ * while they are still in registers, storing the chosen colors straight into
+ * the output column.
+ */
+static void fsdither_kernel_fused(int16_t *input, int16_t *output, size_t color_size, size_t channels,
+                                  int16_t **offset, DTPalettePacked *palette,
+                                  dt_time_t *time, palette_time_t *palette_time)
+{
+    unsigned long long ts1, ts2;
+    __m256i rgb[3];
+
+    TIMESTAMP(ts1);
+    for (size_t k = 0; k < channels; k++)
+        rgb[k] = fsdither_kernel_simd(&input[k*color_size], &output[k*color_size],
+                                      &input[k*color_size+48], offset[k]);
+    TIMESTAMP(ts2);
+    time->dither_time += (ts2 - ts1);
+    time->dither_units += 16;
+
+    if (channels == 1)
+        FindClosestGraysFromPalette(rgb, palette, palette_time);
+    else
+        FindClosestColorsFromPalette(rgb, palette, palette_time);
+    for (size_t k = 0; k < channels; k++)
+        _mm256_store_si256((__m256i*) &output[k*color_size+48], rgb[k]);
+}
+
+/**
+ * Clamps and searches the single pixel at index i of a strip, for the startup
+ * columns.
+ */
+static void fsdither_search_scalar(int16_t *strip_input, int16_t *strip_output, size_t i, size_t color_size,
+                                   size_t channels, DTPalettePacked *palette, palette_time_t *palette_time)
+{
+    if (channels == 1)
+    {
+        strip_output[i] = (int16_t) palette->gray[MAX(MIN(strip_input[i], 255), 0)];
+        return;
+    }
+
+    DTPixel input;
+    input.r = MAX(MIN(strip_input[i+color_size*0], 255), 0);
+    input.g = MAX(MIN(strip_input[i+color_size*1], 255), 0);
+    input.b = MAX(MIN(strip_input[i+color_size*2], 255), 0);
+    DTPixel output = FindClosestColorFromPalette(input, palette, palette_time);
+    strip_output[i+color_size*0] = output.r;
+    strip_output[i+color_size*1] = output.g;
+    strip_output[i+color_size*2] = output.b;
+}
+
+static void
+DTTimeAdd(
+    dt_time_t *dst,
+    dt_time_t *src
+) {
+    dst->shift_time += src->shift_time;
+    dst->shift_units += src->shift_units;
+    dst->dither_time += src->dither_time;
+    dst->dither_units += src->dither_units;
+    dst->deshift_time += src->deshift_time;
+    dst->deshift_units += src->deshift_units;
+    dst->stall_time += src->stall_time;
+}
+
+/**
+ * Error from the last row of a strip is carried into the next strip 32
+ * columns behind the column that produced it, so the first column of strip i
+ * that strip i-1 can still write to is the one it is about to process, minus
+ * 32. Strip i may therefore run column j once strip i-1 has finished column
+ * j+32 (or all of its columns, near the right edge).
+ */
+#define FS_STRIP_LAG 32
+
+/**
+ * Blocks until the strip above has finished every column which carries error
+ * into the given column of this strip, i.e. column + lag. The last seen
+ * progress is cached so the shared counter is only read while actually behind.
+ */
+static void fsdither_wait(size_t *progress, size_t strip, size_t column, size_t width, size_t lag,
+                          size_t *seen, dt_time_t *time)
+{
+    if (progress == NULL || strip == 0)
+        return;
+
+    size_t needed = MIN(column + lag, width - 1) + 1;
+    if (*seen >= needed)
+        return;
+
+    unsigned long long ts1, ts2;
+    TIMESTAMP(ts1);
+    for (unsigned spins = 0; (*seen = __atomic_load_n(&progress[strip-1], __ATOMIC_ACQUIRE)) < needed; spins++)
+    {
+        // Give the core away if the producer is not running alongside us.
+        if (spins < 64)
+            _mm_pause();
+        else
+            sched_yield();
+    }
+    TIMESTAMP(ts2);
+    time->stall_time += (ts2 - ts1);
+}
+
+/**
+ * Dithers strip i, whose skewed input and output start at strip_input and
+ * strip_output with color planes color_size apart (a single plane when
+ * channels is 1, searched with the grey table of the palette). Error from its last row is
+ * carried into next_input, the input of strip i+1 (NULL for the last strip).
+ * When progress is given, each finished column is published in progress[i]
+ * and every column first waits for strip i-1. A non-zero flip_width means the
+ * next strip is mirrored relative to this one (serpentine order), so the
+ * carry for column c lands in its column flip_width-1-c instead.
+ */
+static void fsdither_strip(int16_t *strip_input, int16_t *next_input, int16_t *strip_output,
+                           size_t width, size_t color_size, size_t channels,
+                           size_t i, size_t *progress, size_t flip_width,
+                           DTPalettePacked *palette, dt_time_t* time, palette_time_t *palette_time)
+{
+    __attribute__((aligned(32))) int16_t throwaway[16];
+    size_t seen = 0;
+
+    // Startup
+    for (size_t j = 0; j < MIN(3, width); j++)
+    {
+        fsdither_wait(progress, i, j, width, FS_STRIP_LAG, &seen, time);
+        switch (j)
+        {
+            case 0: // Column 0
+                fsdither_search_scalar(strip_input, strip_output, 0, color_size, channels,
+                                       palette, palette_time);
+                break;
+            case 1: // Column 1
+                for (size_t k = 0; k < channels; k++)
+                    strip_input[16+color_size*k] = fsdither_kernel_scalar(0, 0, 0, 
+                        strip_input[color_size*k],
+                        strip_input[16+color_size*k]);
+                fsdither_search_scalar(strip_input, strip_output, 16, color_size, channels,
+                                       palette, palette_time);
+                break;
+            case 2: // Column 2
+            default:
+                for (size_t k = 0; k < channels; k++) {
+                    strip_input[32+color_size*k] = fsdither_kernel_scalar(0, 0, 0, 
+                        strip_input[16+color_size*k],
+                        strip_input[32+color_size*k]);
+                    strip_input[33+color_size*k] = fsdither_kernel_scalar(strip_input[16+color_size*k],
+                        0, 0, 0, strip_input[33+color_size*k]);
+                }
+                for (size_t k = 0; k < 2; k++)
+                    fsdither_search_scalar(strip_input, strip_output, 32+k, color_size, channels,
+                                           palette, palette_time);
+                break;
+        }   
+        if (progress)
+            __atomic_store_n(&progress[i], j + 1, __ATOMIC_RELEASE);
+    }
+
+    // Steady-State
+    for (size_t j = 3; j < width; j++)
+    {
+        fsdither_wait(progress, i, j, width, FS_STRIP_LAG, &seen, time);
+
+        size_t target = (flip_width && j >= 32) ? flip_width - 1 - (j-32) : j-32;
+        int skip = (next_input == NULL) || (j < 32) || (flip_width && j-32 >= flip_width);
+        int16_t *offset_output[3];
+        for (size_t k = 0; k < channels; k++)
+            offset_output[k] = skip ? &throwaway[0] : &next_input[k*color_size+target*16];
+
+        fsdither_kernel_fused(&strip_input[(j-3)*16], &strip_output[(j-3)*16],
+                              color_size, channels, offset_output, palette, time, palette_time);
+        if (progress)
+            __atomic_store_n(&progress[i], j + 1, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * Runs the strips as a wavefront: strips are dealt round-robin to the
+ * threads, and each one trails the strip above it by FS_STRIP_LAG columns.
+ * Every memory location sees the same sequence of updates as in a serial
+ * top-to-bottom pass, so the output is bit-identical for any thread count.
+ * In serpentine order the next strip runs the other way, so it cannot start
+ * until this one is done, and the strips run on a single thread.
  */
 static void fsdither_runner(int16_t *shifted_input, int16_t *shifted_output, size_t width, size_t height,
+                     size_t channels, size_t image_width, int serpentine,
                      DTPalettePacked *palette, dt_time_t* time, palette_time_t *palette_time)
 {
-    unsigned long color_size = height * width;
-    __attribute__((aligned(32))) int16_t throwaway[16];
-    
-    for (size_t i = 0; i < height / 16; i++)
+    unsigned long long ts1, ts2;
+    const size_t strips = height / 16;
+    size_t *progress = XCalloc(MAX(strips, 1), sizeof(size_t));
+
+    TIMESTAMP(ts1);
+    #pragma omp parallel if (!serpentine)
     {
-        // Constant calculation
-        const size_t offset = i*16*width;
-        const size_t next_offset = (i+1)*16*width;
+        dt_time_t local_time;
+        palette_time_t local_palette_time;
+        DTTimeInit(&local_time);
+        PaletteTimeInit(&local_palette_time);
 
-        // Startup
-        for (size_t j = 0; j < MIN(3, width); j++)
+        #pragma omp for schedule(static, 1)
+        for (size_t i = 0; i < strips; i++)
         {
-            DTPixel input;
-            DTPixel output;
-            switch (j)
-            {
-                case 0: // Column 0
-                    for (size_t k = 0; k < 3; k++)
-                        shifted_input[offset+color_size*k] = shifted_input[offset+color_size*k];
-                    input.r = MAX(MIN(shifted_input[offset+color_size*0], 255), 0);
-                    input.g = MAX(MIN(shifted_input[offset+color_size*1], 255), 0);
-                    input.b = MAX(MIN(shifted_input[offset+color_size*2], 255), 0);
-                    output = FindClosestColorFromPalette(input, palette, palette_time);
-                    shifted_output[offset+color_size*0] = output.r;
-                    shifted_output[offset+color_size*1] = output.g;
-                    shifted_output[offset+color_size*2] = output.b;
-                    break;
-                case 1: // Column 1
-                    for (size_t k = 0; k < 3; k++)
-                        shifted_input[offset+16+color_size*k] = fsdither_kernel_scalar(0, 0, 0, 
-                            shifted_input[offset+color_size*k],
-                            shifted_input[offset+16+color_size*k]);
-                    input.r = MAX(MIN(shifted_input[offset+16+color_size*0], 255), 0);
-                    input.g = MAX(MIN(shifted_input[offset+16+color_size*1], 255), 0);
-                    input.b = MAX(MIN(shifted_input[offset+16+color_size*2], 255), 0);
-                    output = FindClosestColorFromPalette(input, palette, palette_time);
-                    shifted_output[offset+16+color_size*0] = output.r;
-                    shifted_output[offset+16+color_size*1] = output.g;
-                    shifted_output[offset+16+color_size*2] = output.b;
-                    break;
-                case 2: // Column 2
-                default:
-                    for (size_t k = 0; k < 3; k++) {
-                        shifted_input[offset+32+color_size*k] = fsdither_kernel_scalar(0, 0, 0, 
-                            shifted_input[offset+16+color_size*k],
-                            shifted_input[offset+32+color_size*k]);
-                        shifted_input[offset+33+color_size*k] = fsdither_kernel_scalar(shifted_input[offset+16+color_size*k],
-                            0, 0, 0, shifted_input[offset+33+color_size*k]);
-                    }
-                    for (size_t k = 0; k < 2; k++) {
-                        input.r = MAX(MIN(shifted_input[offset+32+k+color_size*0], 255), 0);
-                        input.g = MAX(MIN(shifted_input[offset+32+k+color_size*1], 255), 0);
-                        input.b = MAX(MIN(shifted_input[offset+32+k+color_size*2], 255), 0);
-                        output = FindClosestColorFromPalette(input, palette, palette_time);
-                        shifted_output[offset+32+k+color_size*0] = output.r;
-                        shifted_output[offset+32+k+color_size*1] = output.g;
-                        shifted_output[offset+32+k+color_size*2] = output.b;
-                    }
-                    break;
-            }   
+            const size_t color_size = height * width;
+            fsdither_strip(&shifted_input[i*16*width], (i + 1 < strips) ? &shifted_input[(i+1)*16*width] : NULL,
+                           &shifted_output[i*16*width], width, color_size, channels, i, progress,
+                           serpentine ? image_width : 0, palette, &local_time, &local_palette_time);
         }
 
-        // Steady-State
-        for (size_t j = 3; j < width; j++)
+        #pragma omp critical
+        {
+            DTTimeAdd(time, &local_time);
+            PaletteTimeAdd(palette_time, &local_palette_time);
+            time->threads++;
+        }
+    }
+    TIMESTAMP(ts2);
+    time->wave_time += (ts2 - ts1);
+    time->wave_units += strips * 16 * width;
+
+    XFree(progress);
+}
+
+/*
+ * Generic error diffusion.
+ *
+ * A diffusion matrix is a list of taps (d, dx, w): the pixel d rows below and
+ * dx columns to the right of the current one receives w/divisor of its error.
+ * Each matrix is laid out like Floyd-Steinberg, in 16-row strips with row r
+ * skewed skew*r columns to the right, but the skew is chosen from the
+ * matrix's reach so that every tap lands in a later shifted column. Columns
+ * are then independent across their 16 lanes and the kernel pulls, for each
+ * lane, the errors of the columns that feed it. Errors leaving the bottom of a
+ * strip are carried into the next one, 16*skew columns behind.
+ *
+ * The kernels are specialized per matrix: ED_MATRIX declares the taps as a
+ * constant and ED_SPECIALIZE instantiates the always-inlined strip loop on it,
+ * so every tap's load, weight and lane shift is resolved at compile time.
+ */
+
+typedef struct {
+    int d;
+    int dx;
+    int w;
+} ed_tap_t;
+
+#define ED_MAX_TAPS 12
+
+typedef struct {
+    int divisor;
+    size_t taps;
+    ed_tap_t tap[ED_MAX_TAPS];
+} ed_matrix_t;
+
+#define ED_MATRIX(name, div, ...)\
+    static const ed_matrix_t ed_matrix_##name = {\
+        (div), sizeof((ed_tap_t[]) { __VA_ARGS__ }) / sizeof(ed_tap_t), { __VA_ARGS__ }\
+    }
+
+ED_MATRIX(jjn, 48,
+                       {0, 1, 7}, {0, 2, 5},
+    {1, -2, 3}, {1, -1, 5}, {1, 0, 7}, {1, 1, 5}, {1, 2, 3},
+    {2, -2, 1}, {2, -1, 3}, {2, 0, 5}, {2, 1, 3}, {2, 2, 1});
+
+ED_MATRIX(stucki, 42,
+                       {0, 1, 8}, {0, 2, 4},
+    {1, -2, 2}, {1, -1, 4}, {1, 0, 8}, {1, 1, 4}, {1, 2, 2},
+    {2, -2, 1}, {2, -1, 2}, {2, 0, 4}, {2, 1, 2}, {2, 2, 1});
+
+ED_MATRIX(sierra3, 32,
+                       {0, 1, 5}, {0, 2, 3},
+    {1, -2, 2}, {1, -1, 4}, {1, 0, 5}, {1, 1, 4}, {1, 2, 2},
+                {2, -1, 2}, {2, 0, 3}, {2, 1, 2});
+
+ED_MATRIX(sierra2, 16,
+                       {0, 1, 4}, {0, 2, 3},
+    {1, -2, 1}, {1, -1, 2}, {1, 0, 3}, {1, 1, 2}, {1, 2, 1});
+
+ED_MATRIX(sierra_lite, 4,
+                       {0, 1, 2},
+                {1, -1, 1}, {1, 0, 1});
+
+ED_MATRIX(atkinson, 8,
+                       {0, 1, 1}, {0, 2, 1},
+                {1, -1, 1}, {1, 0, 1}, {1, 1, 1},
+                            {2, 0, 1});
+
+/// @brief Smallest skew putting every tap's target in a later shifted column.
+static inline size_t ed_skew(const ed_matrix_t *m)
+{
+    int skew = 1;
+    for (size_t t = 0; t < m->taps; t++)
+        if (m->tap[t].d > 0)
+            skew = MAX(skew, (m->tap[t].d - m->tap[t].dx + m->tap[t].d - 1) / m->tap[t].d);
+    return (size_t) skew;
+}
+
+/// @brief Farthest shifted column any tap reaches back to; the layout is padded by as much.
+static inline size_t ed_pad(const ed_matrix_t *m)
+{
+    int pad = 0;
+    int skew = (int) ed_skew(m);
+    for (size_t t = 0; t < m->taps; t++)
+        pad = MAX(pad, m->tap[t].dx + skew * m->tap[t].d);
+    return (size_t) pad;
+}
+
+/// @brief Number of rows below the current one that the matrix reaches.
+static inline size_t ed_depth(const ed_matrix_t *m)
+{
+    int depth = 0;
+    for (size_t t = 0; t < m->taps; t++)
+        depth = MAX(depth, m->tap[t].d);
+    return (size_t) depth;
+}
+
+/// @brief w/divisor of each lane, as a shift for powers of two, else in Q16.
+static inline __m256i ed_weight(__m256i error, int w, int divisor)
+{
+    if ((divisor & (divisor - 1)) == 0)
+        return _mm256_srai_epi16(_mm256_mullo_epi16(error, _mm256_set1_epi16(w)), __builtin_ctz(divisor));
+    return _mm256_mulhi_epi16(error, _mm256_set1_epi16((int16_t) ((w * 65536 + divisor / 2) / divisor)));
+}
+
+/// @brief Moves each lane n lanes up; the bottom n lanes read zero.
+#define ED_LANES_UP(v, n)\
+    _mm256_alignr_epi8((v), _mm256_permute2x128_si256((v), (v), 0x08), 16 - 2*(n))
+
+/// @brief Moves the top n lanes down to the bottom; every other lane reads zero.
+#define ED_LANES_OUT(v, n)\
+    _mm256_srli_si256(_mm256_permute2x128_si256((v), (v), 0x81), 16 - 2*(n))
+
+/**
+ * Diffuses error into one column of one channel. input and output point at
+ * the column; the column's new value is stored back into input and returned
+ * clamped, and the error leaving the bottom of the strip is returned in carry.
+ */
+static inline __attribute__((always_inline)) __m256i
+ed_kernel(const ed_matrix_t *m, size_t skew, int16_t *input, int16_t *output, __m256i *carry)
+{
+    __m256i acc[3] = { _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256() };
+
+    for (size_t t = 0; t < m->taps; t++)
+    {
+        const ptrdiff_t back = (ptrdiff_t) (m->tap[t].dx + (int) skew * m->tap[t].d) * 16;
+        __m256i error = _mm256_sub_epi16(_mm256_load_si256((__m256i*) &input[-back]),
+                                         _mm256_load_si256((__m256i*) &output[-back]));
+        acc[m->tap[t].d] = _mm256_add_epi16(acc[m->tap[t].d], ed_weight(error, m->tap[t].w, m->divisor));
+    }
+
+    __m256i value = _mm256_add_epi16(_mm256_load_si256((__m256i*) input), acc[0]);
+    value = _mm256_add_epi16(value, ED_LANES_UP(acc[1], 1));
+    value = _mm256_add_epi16(value, ED_LANES_UP(acc[2], 2));
+    value = _mm256_min_epi16(_mm256_max_epi16(value, _mm256_setzero_si256()), _mm256_set1_epi16(255));
+    _mm256_store_si256((__m256i*) input, value);
+
+    *carry = _mm256_add_epi16(ED_LANES_OUT(acc[1], 1), ED_LANES_OUT(acc[2], 2));
+    return value;
+}
+
+/**
+ * Dithers strip i with the given matrix; same contract as fsdither_strip,
+ * except that the first pad columns are never processed and stay zero, which
+ * is what lets every column run the same kernel. image_width is the width of
+ * the image itself, as opposed to the padded width, and flip is set when the
+ * next strip is mirrored relative to this one.
+ */
+static inline __attribute__((always_inline)) void
+ed_strip(const ed_matrix_t *m, int16_t *strip_input, int16_t *next_input, int16_t *strip_output,
+         size_t width, size_t image_width, size_t color_size, size_t i, size_t *progress, int flip,
+         DTPalettePacked *palette, dt_time_t *time, palette_time_t *palette_time)
+{
+    const size_t skew = ed_skew(m);
+    const size_t pad = ed_pad(m);
+    const size_t lag = 16 * skew;
+    const __m256i lane_skew = _mm256_mullo_epi16(_mm256_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+                                                 _mm256_set1_epi16((int16_t) skew));
+    size_t seen = 0;
+
+    for (size_t j = pad; j < width; j++)
+    {
+        fsdither_wait(progress, i, j, width, lag, &seen, time);
+
+        unsigned long long ts1, ts2;
+        __m256i rgb[3], carry[3];
+
+        TIMESTAMP(ts1);
+        for (size_t k = 0; k < 3; k++)
+            rgb[k] = ed_kernel(m, skew, &strip_input[k*color_size + j*16],
+                               &strip_output[k*color_size + j*16], &carry[k]);
+
+        // Carries landing left of the pad only reach pixels left of the image.
+        if (next_input != NULL && !flip && j >= pad + lag)
         {
             for (size_t k = 0; k < 3; k++)
             {
-                unsigned long long ts1, ts2;
-                int16_t* offset_output = (i >= (height/16-1)) || (j < 32) ? &throwaway[0] : &shifted_input[next_offset+k*color_size+(j-32)*16];
-                TIMESTAMP(ts1);
-                fsdither_kernel_simd(&shifted_input[(j-3)*16+offset+k*color_size],
-                                     &shifted_output[(j-3)*16+offset+k*color_size],
-                                     &shifted_input[j*16+offset+k*color_size], offset_output);
-                TIMESTAMP(ts2);
-                time->dither_time += (ts2 - ts1);
+                int16_t *target = &next_input[k*color_size + (j - lag)*16];
+                _mm256_store_si256((__m256i*) target,
+                                   _mm256_add_epi16(_mm256_load_si256((__m256i*) target), carry[k]));
             }
-            time->dither_units += 16;
+        }
+        // Into a mirrored strip, each carried lane lands in its own column.
+        if (next_input != NULL && flip)
+        {
+            __attribute__((aligned(32))) int16_t lanes[3][16];
+            for (size_t k = 0; k < 3; k++)
+                _mm256_store_si256((__m256i*) lanes[k], carry[k]);
 
-            for (size_t k = 0; k < 16; k++)
+            for (size_t r = 0; r < ed_depth(m); r++)
             {
-                DTPixel input;
-                input.r = shifted_input[j*16+offset+0*color_size+k];
-                input.g = shifted_input[j*16+offset+1*color_size+k];
-                input.b = shifted_input[j*16+offset+2*color_size+k];
-                DTPixel output = FindClosestColorFromPalette(input, palette, palette_time);
-                shifted_output[j*16+offset+k+color_size*0] = output.r;
-                shifted_output[j*16+offset+k+color_size*1] = output.g;
-                shifted_output[j*16+offset+k+color_size*2] = output.b;
+                ptrdiff_t x = (ptrdiff_t) j - (ptrdiff_t) (lag + pad + skew*r);
+                if (x < 0 || x >= (ptrdiff_t) image_width)
+                    continue;
+                size_t target = pad + (image_width - 1 - (size_t) x) + skew*r;
+                for (size_t k = 0; k < 3; k++)
+                    next_input[k*color_size + target*16 + r] += lanes[k][r];
             }
         }
+        TIMESTAMP(ts2);
+        time->dither_time += (ts2 - ts1);
+        time->dither_units += 16;
+
+        __m256i value[3] = { rgb[0], rgb[1], rgb[2] };
+        FindClosestColorsFromPalette(rgb, palette, palette_time);
+
+        // Lanes off either side of the image keep their own value as output,
+        // so the error they pick up is dropped rather than flowing back in.
+        // Lane r holds x = j - pad - skew*r; both tests are clamped to small
+        // numbers, as only the first and last 15*skew columns have such lanes.
+        if (j < pad + 15*skew || j >= pad + image_width)
+        {
+            const ptrdiff_t x0 = (ptrdiff_t) (j - pad);
+            __m256i left = _mm256_sub_epi16(_mm256_set1_epi16((int16_t) MIN(x0, (ptrdiff_t) (15*skew))), lane_skew);
+            __m256i right = _mm256_sub_epi16(_mm256_set1_epi16((int16_t) MAX(x0 - (ptrdiff_t) image_width, -1)), lane_skew);
+            __m256i ghost = _mm256_or_si256(_mm256_cmpgt_epi16(_mm256_setzero_si256(), left),
+                                            _mm256_cmpgt_epi16(right, _mm256_set1_epi16(-1)));
+            for (size_t k = 0; k < 3; k++)
+                rgb[k] = _mm256_blendv_epi8(rgb[k], value[k], ghost);
+        }
+
+        for (size_t k = 0; k < 3; k++)
+            _mm256_store_si256((__m256i*) &strip_output[k*color_size + j*16], rgb[k]);
+
+        if (progress)
+            __atomic_store_n(&progress[i], j + 1, __ATOMIC_RELEASE);
     }
 }
 
+typedef void (*ed_strip_fn)(int16_t *strip_input, int16_t *next_input, int16_t *strip_output,
+                            size_t width, size_t image_width, size_t color_size, size_t i, size_t *progress, int flip,
+                            DTPalettePacked *palette, dt_time_t *time, palette_time_t *palette_time);
+
+#define ED_SPECIALIZE(name)\
+    static void ed_strip_##name(int16_t *strip_input, int16_t *next_input, int16_t *strip_output,\
+                                size_t width, size_t image_width, size_t color_size, size_t i,\
+                                size_t *progress, int flip, DTPalettePacked *palette, dt_time_t *time,\
+                                palette_time_t *palette_time)\
+    {\
+        ed_strip(&ed_matrix_##name, strip_input, next_input, strip_output, width, image_width,\
+                 color_size, i, progress, flip, palette, time, palette_time);\
+    }
+
+ED_SPECIALIZE(jjn)
+ED_SPECIALIZE(stucki)
+ED_SPECIALIZE(sierra3)
+ED_SPECIALIZE(sierra2)
+ED_SPECIALIZE(sierra_lite)
+ED_SPECIALIZE(atkinson)
+
+/// @brief Specialized strip loop and matrix for each DTDiffusionMatrix.
+static const struct {
+    ed_strip_fn strip;
+    const ed_matrix_t *matrix;
+} ed_specializations[] = {
+    [DT_DIFFUSION_JJN] = { ed_strip_jjn, &ed_matrix_jjn },
+    [DT_DIFFUSION_STUCKI] = { ed_strip_stucki, &ed_matrix_stucki },
+    [DT_DIFFUSION_SIERRA3] = { ed_strip_sierra3, &ed_matrix_sierra3 },
+    [DT_DIFFUSION_SIERRA2] = { ed_strip_sierra2, &ed_matrix_sierra2 },
+    [DT_DIFFUSION_SIERRA_LITE] = { ed_strip_sierra_lite, &ed_matrix_sierra_lite },
+    [DT_DIFFUSION_ATKINSON] = { ed_strip_atkinson, &ed_matrix_atkinson },
+};
+
 /**
- * 
- * 
+ * Runs the strips of a generic diffusion as a wavefront (or one after the
+ * other, in serpentine order), exactly like fsdither_runner.
  */
-static void shift_memory(DTPixel *pixels, int16_t* shifted_memory, size_t width, size_t height,
-                        size_t padded_width, size_t padded_height, dt_time_t *time)
+static void ed_runner(ed_strip_fn strip, int16_t *shifted_input, int16_t *shifted_output,
+                      size_t width, size_t height, size_t image_width, int serpentine, DTPalettePacked *palette,
+                      dt_time_t *time, palette_time_t *palette_time)
 {
     unsigned long long ts1, ts2;
+    const size_t strips = height / 16;
+    size_t *progress = XCalloc(MAX(strips, 1), sizeof(size_t));
+
     TIMESTAMP(ts1);
+    #pragma omp parallel if (!serpentine)
+    {
+        dt_time_t local_time;
+        palette_time_t local_palette_time;
+        DTTimeInit(&local_time);
+        PaletteTimeInit(&local_palette_time);
 
-    unsigned long color_size = padded_height * padded_width;
+        #pragma omp for schedule(static, 1)
+        for (size_t i = 0; i < strips; i++)
+        {
+            const size_t color_size = height * width;
+            strip(&shifted_input[i*16*width], (i + 1 < strips) ? &shifted_input[(i+1)*16*width] : NULL,
+                  &shifted_output[i*16*width], width, image_width, color_size, i, progress,
+                  serpentine, palette, &local_time, &local_palette_time);
+        }
+
+        #pragma omp critical
+        {
+            DTTimeAdd(time, &local_time);
+            PaletteTimeAdd(palette_time, &local_palette_time);
+            time->threads++;
+        }
+    }
+    TIMESTAMP(ts2);
+    time->wave_time += (ts2 - ts1);
+    time->wave_units += strips * 16 * width;
+
+    XFree(progress);
+}
+
+/**
+ * Transposes a 16x16 block of int16s in place: two 8x8 in-lane transposes
+ * (rows 0-7 and 8-15), then a 128-bit swap to stitch the halves together.
+ */
+static inline void transpose_16x16_epi16(__m256i m[16])
+{
+    __m256i d[2][8];
+
+    for (size_t h = 0; h < 2; h++)
+    {
+        __m256i *a = &m[h*8];
+        __m256i b[8], c[8];
+
+        for (size_t k = 0; k < 4; k++)
+        {
+            b[2*k] = _mm256_unpacklo_epi16(a[2*k], a[2*k+1]);
+            b[2*k+1] = _mm256_unpackhi_epi16(a[2*k], a[2*k+1]);
+        }
+        for (size_t k = 0; k < 2; k++)
+        {
+            c[4*k+0] = _mm256_unpacklo_epi32(b[4*k+0], b[4*k+2]);
+            c[4*k+1] = _mm256_unpackhi_epi32(b[4*k+0], b[4*k+2]);
+            c[4*k+2] = _mm256_unpacklo_epi32(b[4*k+1], b[4*k+3]);
+            c[4*k+3] = _mm256_unpackhi_epi32(b[4*k+1], b[4*k+3]);
+        }
+        for (size_t k = 0; k < 4; k++)
+        {
+            d[h][2*k] = _mm256_unpacklo_epi64(c[k], c[k+4]);
+            d[h][2*k+1] = _mm256_unpackhi_epi64(c[k], c[k+4]);
+        }
+    }
+
+    for (size_t k = 0; k < 8; k++)
+    {
+        m[k] = _mm256_permute2x128_si256(d[0][k], d[1][k], 0x20);
+        m[k+8] = _mm256_permute2x128_si256(d[0][k], d[1][k], 0x31);
+    }
+}
+
+/// @brief Reverses the order of the 16 int16 lanes of v.
+static inline __m256i reverse_epi16(__m256i v)
+{
+    const __m256i order = _mm256_setr_epi8(14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1,
+                                           14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1);
+    return _mm256_shuffle_epi8(_mm256_permute4x64_epi64(v, 0x4E), order);
+}
+
+/**
+ * Skews one 16-row strip into the int16 layout: shifted column c, lane r holds
+ * pixel (r, c - pad - skew*r). Floyd-Steinberg uses a skew of 2 and no pad.
+ * A mirrored strip holds its rows right to left instead, pixel
+ * (r, width-1 - (c - pad - skew*r)), so that scanning it runs backwards over
+ * the image. Sixteen rows are loaded at a time, each offset by its skew, and
+ * transposed so that each row becomes a lane. Every lane of every column in
+ * [0, padded_width) is written, so the strip needs no clearing.
+ */
+static void shift_strip(DTPixel *pixels, size_t width, size_t height, size_t strip,
+                        int16_t *shifted, size_t padded_width, size_t color_size,
+                        size_t skew, size_t pad, int mirror)
+{
+    for (size_t x = 0; x < padded_width; x += 16)
+    {
+        __m256i block[3][16];
+
+        for (size_t r = 0; r < 16; r++)
+        {
+            size_t i = strip*16 + r;
+            __m256i rgb[3] = { _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256() };
+            ptrdiff_t col = (ptrdiff_t) x - (ptrdiff_t) (pad + skew*r);
+            if (i < height && !mirror)
+                load_pixels16(&pixels[i*width], col, width, rgb);
+            if (i < height && mirror)
+            {
+                load_pixels16(&pixels[i*width], (ptrdiff_t) width - 16 - col, width, rgb);
+                for (size_t c = 0; c < 3; c++)
+                    rgb[c] = reverse_epi16(rgb[c]);
+            }
+            for (size_t c = 0; c < 3; c++)
+                block[c][r] = rgb[c];
+        }
+
+        size_t columns = MIN(16, padded_width - x);
+        for (size_t c = 0; c < 3; c++)
+        {
+            transpose_16x16_epi16(block[c]);
+            for (size_t t = 0; t < columns; t++)
+                _mm256_store_si256((__m256i*) &shifted[(x+t)*16 + c*color_size], block[c][t]);
+        }
+    }
+}
 
-    for (size_t i = 0; i < height; i++)
+/**
+ * Inverse of shift_strip: transposes 16 skewed columns back into rows and
+ * packs them straight into the destination pixels.
+ */
+static void deshift_strip(DTPixel *pixels, size_t width, size_t height, size_t strip,
+                          int16_t *shifted, size_t padded_width, size_t color_size,
+                          size_t skew, size_t pad, int mirror)
+{
+    size_t rows = MIN(16, height - strip*16);
+
+    for (size_t x = 0; x < padded_width; x += 16)
     {
-        for (size_t j = 0; j < width; j++)
+        __m256i block[3][16];
+
+        size_t columns = MIN(16, padded_width - x);
+        for (size_t c = 0; c < 3; c++)
         {
-            DTPixel val = pixels[i*width+j];
-            size_t shift_index = (i/16)*16*padded_width + (j+(i%16)*2)*16 + (i%16);
+            for (size_t t = 0; t < 16; t++)
+                block[c][t] = (t < columns) ? _mm256_load_si256((__m256i*) &shifted[(x+t)*16 + c*color_size])
+                                            : _mm256_setzero_si256();
+            transpose_16x16_epi16(block[c]);
+        }
 
-            shifted_memory[shift_index + 0] = val.r;
-            shifted_memory[shift_index + 1*color_size] = val.g;
-            shifted_memory[shift_index + 2*color_size] =  val.b;
+        for (size_t r = 0; r < rows; r++)
+        {
+            __m256i rgb[3] = { block[0][r], block[1][r], block[2][r] };
+            ptrdiff_t col = (ptrdiff_t) x - (ptrdiff_t) (pad + skew*r);
+            if (mirror)
+            {
+                for (size_t c = 0; c < 3; c++)
+                    rgb[c] = reverse_epi16(rgb[c]);
+                col = (ptrdiff_t) width - 16 - col;
+            }
+            store_pixels16(&pixels[(strip*16 + r)*width], col, width, rgb);
         }
     }
+}
+
+/**
+ * Single-channel versions of shift_strip and deshift_strip, for grey images:
+ * one plane per strip, same layout.
+ */
+static void shift_strip_gray(const byte *gray, size_t width, size_t height, size_t strip,
+                             int16_t *shifted, size_t padded_width, size_t skew, size_t pad, int mirror)
+{
+    for (size_t x = 0; x < padded_width; x += 16)
+    {
+        __m256i block[16];
+
+        for (size_t r = 0; r < 16; r++)
+        {
+            size_t i = strip*16 + r;
+            ptrdiff_t col = (ptrdiff_t) x - (ptrdiff_t) (pad + skew*r);
+            block[r] = _mm256_setzero_si256();
+            if (i < height && !mirror)
+                block[r] = load_gray16(&gray[i*width], col, width);
+            if (i < height && mirror)
+                block[r] = reverse_epi16(load_gray16(&gray[i*width], (ptrdiff_t) width - 16 - col, width));
+        }
+
+        transpose_16x16_epi16(block);
+        for (size_t t = 0; t < MIN(16, padded_width - x); t++)
+            _mm256_store_si256((__m256i*) &shifted[(x+t)*16], block[t]);
+    }
+}
+
+static void deshift_strip_gray(byte *gray, size_t width, size_t height, size_t strip,
+                               int16_t *shifted, size_t padded_width, size_t skew, size_t pad, int mirror)
+{
+    size_t rows = MIN(16, height - strip*16);
+
+    for (size_t x = 0; x < padded_width; x += 16)
+    {
+        __m256i block[16];
+
+        size_t columns = MIN(16, padded_width - x);
+        for (size_t t = 0; t < 16; t++)
+            block[t] = (t < columns) ? _mm256_load_si256((__m256i*) &shifted[(x+t)*16]) : _mm256_setzero_si256();
+        transpose_16x16_epi16(block);
+
+        for (size_t r = 0; r < rows; r++)
+        {
+            ptrdiff_t col = (ptrdiff_t) x - (ptrdiff_t) (pad + skew*r);
+            if (mirror)
+                store_gray16(&gray[(strip*16 + r)*width], (ptrdiff_t) width - 16 - col, width,
+                             reverse_epi16(block[r]));
+            else
+                store_gray16(&gray[(strip*16 + r)*width], col, width, block[r]);
+        }
+    }
+}
+
+/**
+ * 
+ * 
+ */
+static void shift_memory(DTPixel *pixels, int16_t* shifted_memory, size_t width, size_t height,
+                        size_t padded_width, size_t padded_height, size_t skew, size_t pad,
+                        int serpentine, dt_time_t *time)
+{
+    unsigned long long ts1, ts2;
+    TIMESTAMP(ts1);
+
+    unsigned long color_size = padded_height * padded_width;
+
+    #pragma omp parallel for schedule(static)
+    for (size_t s = 0; s < padded_height / 16; s++)
+        shift_strip(pixels, width, height, s, &shifted_memory[s*16*padded_width], padded_width, color_size,
+                    skew, pad, serpentine && (s % 2));
 
     TIMESTAMP(ts2);
     time->shift_time += (ts2 - ts1);
@@ -281,44 +888,24 @@ static void shift_memory(DTPixel *pixels, int16_t* shifted_memory, size_t width,
  * 
  */
 static void deshift_memory(DTPixel *pixels, int16_t* shifted, size_t width, size_t height,
-                        size_t padded_width, size_t padded_height, dt_time_t *time)
+                        size_t padded_width, size_t padded_height, size_t skew, size_t pad,
+                        int serpentine, dt_time_t *time)
 {
     unsigned long long ts1, ts2;
     TIMESTAMP(ts1);
 
     unsigned long color_size = padded_height * padded_width;
 
-    for (size_t i = 0; i < height; i++)
-    {
-        for (size_t j = 0; j < width; j++)
-        {
-            size_t shift_index = (i/16)*16*padded_width +(j+(i%16)*2)*16 + (i%16);
-            pixels[i*width+j].r = shifted[shift_index + 0];
-            pixels[i*width+j].g = shifted[shift_index + 1*color_size];
-            pixels[i*width+j].b = shifted[shift_index + 2*color_size];
-        }
-    }
+    #pragma omp parallel for schedule(static)
+    for (size_t s = 0; s < padded_height / 16; s++)
+        deshift_strip(pixels, width, height, s, &shifted[s*16*padded_width], padded_width, color_size,
+                      skew, pad, serpentine && (s % 2));
 
     TIMESTAMP(ts2);
     time->deshift_time += (ts2 - ts1);
     time->deshift_units += color_size;
 }
 
-/*
-static void
-DTTimeAdd(
-    dt_time_t *dst,
-    dt_time_t *src
-) {
-    dst->shift_time += src->shift_time;
-    dst->shift_units += src->shift_units;
-    dst->dither_time += src->dither_time;
-    dst->dither_units += src->dither_units;
-    dst->deshift_time += src->deshift_time;
-    dst->deshift_units += src->deshift_units;
-}
-*/
-
 void DTTimeInit(dt_time_t *time)
 {
     assert(time);
@@ -327,29 +914,40 @@ void DTTimeInit(dt_time_t *time)
 
 void DTTimeReport(dt_time_t *time)
 {
-    // const double shift_theoretical = (16.0/3.0);
+    const double shift_theoretical = (16.0/3.0);
     const double dither_theoretical = (1/1.3125);
-    // const double deshift_theoretical = (2*16.0/3.0);
+    const double deshift_theoretical = (2*16.0/3.0);
 
-    // double shift_time = TIME_NORM(0, time->shift_time);
-    // double shift_pix = ((double)time->shift_units) / shift_time;
-    // double shift_peak = (shift_pix / shift_theoretical) * 100;
+    double shift_time = TIME_NORM(0, time->shift_time);
+    double shift_pix = ((double)time->shift_units) / shift_time;
+    double shift_peak = (shift_pix / shift_theoretical) * 100;
 
     double dither_time = TIME_NORM(0, time->dither_time);
     double dither_pix = ((double)time->dither_units) / dither_time;
     double dither_peak = (dither_pix / dither_theoretical) * 100;
 
-    // double deshift_time = TIME_NORM(0, time->deshift_time);
-    // double deshift_pix = ((double)time->deshift_units) / deshift_time;
-    // double deshift_peak = (deshift_pix / deshift_theoretical) * 100;
+    double deshift_time = TIME_NORM(0, time->deshift_time);
+    double deshift_pix = ((double)time->deshift_units) / deshift_time;
+    double deshift_peak = (deshift_pix / deshift_theoretical) * 100;
 
-    // printf("Shift%20s%-20.6lf%-20.6lf%.2lf%%\n", "", shift_time, shift_pix, shift_peak);
+    // Methods without a skewed layout leave the shift stages empty.
+    if (time->shift_units)
+        printf("Shift%20s%-20.6lf%-20.6lf%.2lf%%\n", "", shift_time, shift_pix, shift_peak);
     printf("Dither%19s%-20.6lf%-20.6lf%.2lf%%\n", "", dither_time, dither_pix, dither_peak);
-    // printf("Deshift%18s%-20.6lf%-20.6lf%.2lf%%\n", "", deshift_time, deshift_pix, deshift_peak);
+    if (time->deshift_units)
+        printf("Deshift%18s%-20.6lf%-20.6lf%.2lf%%\n", "", deshift_time, deshift_pix, deshift_peak);
+
+    // Wall-clock view of the strip wavefront; stall is the share of thread
+    // time spent waiting on the strip above.
+    double wave_time = TIME_NORM(0, time->wave_time);
+    double wave_pix = ((double)time->wave_units) / wave_time;
+    double wave_work = TIME_NORM(0, time->dither_time) + TIME_NORM(0, time->stall_time);
+    double stall_share = (TIME_NORM(0, time->stall_time) / wave_work) * 100;
+    printf("Wavefront (%2u thr)%7s%-20.6lf%-20.6lf%.2lf%% stall\n", time->threads, "", wave_time, wave_pix, stall_share);
 }
 
 void
-ApplyFloydSteinbergDither(DTImage *image, DTPalettePacked *palette, palette_time_t *palette_time)
+ApplyFloydSteinbergDither(DTImage *image, DTPalettePacked *palette, int serpentine, palette_time_t *palette_time)
 {
     dt_time_t t;
     DTTimeInit(&t);
@@ -363,14 +961,13 @@ ApplyFloydSteinbergDither(DTImage *image, DTPalettePacked *palette, palette_time
     size_t color_size = shifted_width * shifted_height;
     size_t memory_size = 3 * color_size * sizeof(int16_t);
 
-    // Allocate Input Scratch Memory
+    // Allocate Input Scratch Memory (shift_memory writes every element)
     int16_t* shifted_memory;
     posix_memalign((void**) &shifted_memory, 64, memory_size);
-    memset(shifted_memory, 0, memory_size);
 
     // Load Pixels Into Shifted Format
     shift_memory(image->pixels, shifted_memory, width, height,
-                 shifted_width, shifted_height, &t);
+                 shifted_width, shifted_height, 2, 0, serpentine, &t);
     
     // Allocate Output Scratch Memory
     int16_t *shifted_output;
@@ -378,9 +975,10 @@ ApplyFloydSteinbergDither(DTImage *image, DTPalettePacked *palette, palette_time
     memset(shifted_output, 0, 3*shifted_width*shifted_height*sizeof(int16_t));
 
     // Run Kernel and De-Shift Output
-    fsdither_runner(shifted_memory, shifted_output, shifted_width, shifted_height, palette, &t, palette_time);
+    fsdither_runner(shifted_memory, shifted_output, shifted_width, shifted_height, 3, width, serpentine,
+                    palette, &t, palette_time);
     deshift_memory(image->pixels, shifted_output, image->width, image->height,
-                                             shifted_width, shifted_height, &t);
+                                             shifted_width, shifted_height, 2, 0, serpentine, &t);
 
     DTTimeReport(&t);
 
@@ -388,3 +986,599 @@ ApplyFloydSteinbergDither(DTImage *image, DTPalettePacked *palette, palette_time
     free(shifted_memory);
     free(shifted_output);
 }
+
+/*
+ * Floyd-Steinberg on a single-channel image: the same strips and wavefront,
+ * but one plane instead of three and a table lookup instead of the palette
+ * search. The output matches the three-channel path for the same grey input.
+ */
+void
+ApplyFloydSteinbergDitherGray(DTImage *image, DTPalettePacked *palette, int serpentine,
+                              palette_time_t *palette_time)
+{
+    assert(image->gray && palette->gray);
+
+    dt_time_t t;
+    DTTimeInit(&t);
+
+    size_t width = image->width;
+    size_t height = image->height;
+
+    size_t shifted_width = (height <= 16) ? width + 2*(height-1) : width + 2*(16-1);
+    size_t shifted_height = (height / 16) * 16 + (height % 16 > 0) * 16;
+    size_t color_size = shifted_width * shifted_height;
+
+    int16_t *shifted_memory = XMemalign(64, color_size * sizeof(int16_t));
+    int16_t *shifted_output = XMemalign(64, color_size * sizeof(int16_t));
+    memset(shifted_output, 0, color_size * sizeof(int16_t));
+
+    unsigned long long ts1, ts2;
+
+    TIMESTAMP(ts1);
+    #pragma omp parallel for schedule(static)
+    for (size_t s = 0; s < shifted_height / 16; s++)
+        shift_strip_gray(image->gray, width, height, s, &shifted_memory[s*16*shifted_width], shifted_width,
+                         2, 0, serpentine && (s % 2));
+    TIMESTAMP(ts2);
+    t.shift_time += (ts2 - ts1);
+    t.shift_units += color_size;
+
+    fsdither_runner(shifted_memory, shifted_output, shifted_width, shifted_height, 1, width, serpentine,
+                    palette, &t, palette_time);
+
+    TIMESTAMP(ts1);
+    #pragma omp parallel for schedule(static)
+    for (size_t s = 0; s < shifted_height / 16; s++)
+        deshift_strip_gray(image->gray, width, height, s, &shifted_output[s*16*shifted_width], shifted_width,
+                           2, 0, serpentine && (s % 2));
+    TIMESTAMP(ts2);
+    t.deshift_time += (ts2 - ts1);
+    t.deshift_units += color_size;
+
+    DTTimeReport(&t);
+
+    XFree(shifted_memory);
+    XFree(shifted_output);
+}
+
+/**
+ * Dithers a width x height block of pixels one strip at a time on the calling
+ * thread. Error only carries from strip i into strip i+1, so the input is a
+ * ring of two strips (each holding its three color planes back to back), and
+ * the output only ever holds the strip being dithered.
+ */
+static void fsdither_serial(DTPixel *pixels, size_t width, size_t height, int serpentine,
+                            DTPalettePacked *palette, dt_time_t *t, palette_time_t *palette_time)
+{
+    // Same padding as ApplyFloydSteinbergDither, but only strip-sized planes.
+    size_t shifted_width = (height <= 16) ? width + 2*(height-1) : width + 2*(16-1);
+    size_t strips = (height / 16) + (height % 16 > 0);
+    size_t strip_size = 16 * shifted_width;
+
+    int16_t *ring = XMemalign(64, 2*3*strip_size*sizeof(int16_t));
+    int16_t *output = XMemalign(64, 3*strip_size*sizeof(int16_t));
+
+    unsigned long long ts1, ts2;
+
+    TIMESTAMP(ts1);
+    shift_strip(pixels, width, height, 0, ring, shifted_width, strip_size, 2, 0, 0);
+    TIMESTAMP(ts2);
+    t->shift_time += (ts2 - ts1);
+    t->shift_units += strip_size;
+
+    for (size_t i = 0; i < strips; i++)
+    {
+        int16_t *strip_input = &ring[(i % 2)*3*strip_size];
+        int16_t *next_input = NULL;
+
+        // Fill the next strip before this one carries error into it.
+        if (i + 1 < strips)
+        {
+            next_input = &ring[((i + 1) % 2)*3*strip_size];
+            TIMESTAMP(ts1);
+            shift_strip(pixels, width, height, i + 1, next_input, shifted_width, strip_size, 2, 0,
+                        serpentine && ((i + 1) % 2));
+            TIMESTAMP(ts2);
+            t->shift_time += (ts2 - ts1);
+            t->shift_units += strip_size;
+        }
+
+        // The startup columns only write the lanes holding real pixels; the
+        // rest must read back as zero, as from a freshly cleared buffer.
+        for (size_t k = 0; k < 3; k++)
+            memset(&output[k*strip_size], 0, MIN(3, shifted_width)*16*sizeof(int16_t));
+
+        fsdither_strip(strip_input, next_input, output, shifted_width, strip_size, 3, i, NULL,
+                       serpentine ? width : 0, palette, t, palette_time);
+
+        // Drain the finished strip straight into the image.
+        TIMESTAMP(ts1);
+        deshift_strip(pixels, width, height, i, output, shifted_width, strip_size, 2, 0,
+                      serpentine && (i % 2));
+        TIMESTAMP(ts2);
+        t->deshift_time += (ts2 - ts1);
+        t->deshift_units += strip_size;
+    }
+
+    t->wave_units += strips * strip_size;
+
+    XFree(ring);
+    XFree(output);
+}
+
+void
+ApplyFloydSteinbergDitherLowMemory(DTImage *image, DTPalettePacked *palette, int serpentine,
+                                   palette_time_t *palette_time)
+{
+    dt_time_t t;
+    DTTimeInit(&t);
+
+    unsigned long long ws1, ws2;
+    TIMESTAMP(ws1);
+    fsdither_serial(image->pixels, image->width, image->height, serpentine, palette, &t, palette_time);
+    TIMESTAMP(ws2);
+    t.wave_time += (ws2 - ws1);
+    t.threads = 1;
+
+    DTTimeReport(&t);
+}
+
+/*
+ * Columns and rows of context dithered around each tile and then thrown
+ * away, so that the tile starts with the error its left, top and top-right
+ * neighbours would have carried into it.
+ */
+#define FS_TILE_OVERLAP 16
+
+void
+ApplyFloydSteinbergDitherTiled(DTImage *image, DTPalettePacked *palette, size_t tile_size, int serpentine,
+                               palette_time_t *palette_time)
+{
+    dt_time_t t;
+    DTTimeInit(&t);
+
+    size_t width = image->width;
+    size_t height = image->height;
+    size_t tiles_x = (width + tile_size - 1) / tile_size;
+    size_t tiles = tiles_x * ((height + tile_size - 1) / tile_size);
+
+    unsigned long long ws1, ws2;
+    TIMESTAMP(ws1);
+
+    // Overlaps are read from a pristine copy, as neighbouring tiles may
+    // already have written their output back.
+    DTPixel *source = XMalloc(width * height * sizeof(DTPixel));
+    memcpy(source, image->pixels, width * height * sizeof(DTPixel));
+
+    #pragma omp parallel
+    {
+        dt_time_t local_time;
+        palette_time_t local_palette_time;
+        DTTimeInit(&local_time);
+        PaletteTimeInit(&local_palette_time);
+
+        // Tiles never reach past the image, however large the size asked for.
+        DTPixel *region = XMalloc((MIN(tile_size, width) + 2*FS_TILE_OVERLAP) *
+                                  (MIN(tile_size, height) + FS_TILE_OVERLAP) * sizeof(DTPixel));
+
+        #pragma omp for schedule(dynamic)
+        for (size_t k = 0; k < tiles; k++)
+        {
+            size_t x0 = (k % tiles_x) * tile_size;
+            size_t y0 = (k / tiles_x) * tile_size;
+            size_t x1 = MIN(x0 + tile_size, width);
+            size_t y1 = MIN(y0 + tile_size, height);
+
+            // The tile plus its overlap, clipped to the image.
+            size_t rx0 = x0 - MIN(x0, FS_TILE_OVERLAP);
+            size_t ry0 = y0 - MIN(y0, FS_TILE_OVERLAP);
+            size_t rx1 = MIN(x1 + FS_TILE_OVERLAP, width);
+            size_t rw = rx1 - rx0;
+
+            for (size_t y = ry0; y < y1; y++)
+                memcpy(&region[(y - ry0)*rw], &source[y*width + rx0], rw * sizeof(DTPixel));
+
+            fsdither_serial(region, rw, y1 - ry0, serpentine, palette, &local_time, &local_palette_time);
+
+            for (size_t y = y0; y < y1; y++)
+                memcpy(&image->pixels[y*width + x0], &region[(y - ry0)*rw + (x0 - rx0)],
+                       (x1 - x0) * sizeof(DTPixel));
+        }
+
+        XFree(region);
+
+        #pragma omp critical
+        {
+            DTTimeAdd(&t, &local_time);
+            PaletteTimeAdd(palette_time, &local_palette_time);
+            t.threads++;
+        }
+    }
+
+    XFree(source);
+
+    TIMESTAMP(ws2);
+    t.wave_time = (ws2 - ws1);
+    t.wave_units = width * height;
+
+    DTTimeReport(&t);
+}
+
+/*
+ * Low-precision Floyd-Steinberg.
+ *
+ * Same skewed layout as the int16 engine (lane r of column c holds pixel
+ * (r, c - 2r)), but with 32-row strips of bytes: each pixel is stored as its
+ * value minus 128, so that saturating byte arithmetic clamps it to [0, 255],
+ * and every register holds a whole column of 32 pixels. The four taps are
+ * two maddubs over (error, error of the lane above) byte pairs, and errors
+ * are kept as saturated bytes, which is exact as long as they stay within
+ * +-127 (grey palettes with evenly spaced levels). Chosen colors overwrite
+ * the input in place, so a strip needs no output buffer.
+ */
+#define FS8_ROWS 32
+
+// The last row carries error into the next strip 2*FS8_ROWS columns back.
+#define FS8_STRIP_LAG (2*FS8_ROWS)
+
+/// @brief Moves every byte lane up by one across the whole register, lane 0 reading zero.
+static inline __m256i fs8_lane_up(__m256i v)
+{
+    return _mm256_alignr_epi8(v, _mm256_permute2x128_si256(v, v, 0x08), 15);
+}
+
+/**
+ * Dithers strip i of the byte layout, carrying error from its last row into
+ * next_input (NULL for the last strip). rows is the number of real rows in
+ * the strip and image_width the number of real pixels per row; lanes outside
+ * them are dithered but send no error.
+ */
+static void fs8_strip(int8_t *strip_input, int8_t *next_input, size_t width, size_t color_size,
+                      size_t image_width, size_t rows, size_t i, size_t *progress,
+                      DTPalettePacked *palette, dt_time_t *time, palette_time_t *palette_time)
+{
+    const __m256i w73 = _mm256_set1_epi16((3 << 8) | 7);
+    const __m256i w51 = _mm256_set1_epi16((1 << 8) | 5);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i x80 = _mm256_set1_epi16(128);
+    const __m256i x255 = _mm256_set1_epi16(255);
+    const __m256i skew = _mm256_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30,
+                                          32, 34, 36, 38, 40, 42, 44, 46, 48, 50, 52, 54, 56, 58, 60, 62);
+    const __m256i lane = _mm256_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+                                          16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31);
+    const __m256i real_rows = _mm256_cmpgt_epi8(_mm256_set1_epi8((int8_t) rows), lane);
+
+    // Errors of the last three columns, and the same moved up one lane.
+    __m256i e1[3], e2[3], e3[3], u2[3], u3[3];
+    for (size_t k = 0; k < 3; k++)
+        e1[k] = e2[k] = e3[k] = u2[k] = u3[k] = zero;
+
+    // Timed as a whole, less the searches and stalls, rather than per column.
+    unsigned long long ts1, ts2;
+    unsigned long long searched = palette_time->search_time, stalled = time->stall_time;
+    TIMESTAMP(ts1);
+
+    size_t seen = 0;
+    for (size_t c = 0; c < width; c++)
+    {
+        fsdither_wait(progress, i, c, width, FS8_STRIP_LAG, &seen, time);
+
+        // Lanes whose pixel lies off the image at this column.
+        __m256i real = real_rows;
+        if (c < 2*FS8_ROWS)
+            real = _mm256_and_si256(real, _mm256_cmpgt_epi8(_mm256_set1_epi8((int8_t) (c + 1)), skew));
+        if (c >= image_width)
+            real = _mm256_and_si256(real, _mm256_cmpgt_epi8(skew, _mm256_set1_epi8((int8_t) (c - image_width))));
+
+        // The pixel below the last row gets its share of the last three
+        // columns; it lives 2*FS8_ROWS columns back in the next strip.
+        if (next_input && c >= FS8_STRIP_LAG && c - FS8_STRIP_LAG < image_width)
+            for (size_t k = 0; k < 3; k++)
+            {
+                // extract_epi8 zero-extends, so the bytes are cast back to signed.
+                int carry = (3*(int8_t) _mm256_extract_epi8(e1[k], 31) +
+                             5*(int8_t) _mm256_extract_epi8(e2[k], 31) +
+                             (int8_t) _mm256_extract_epi8(e3[k], 31)) >> 4;
+                int8_t *to = &next_input[k*color_size + (c - FS8_STRIP_LAG)*FS8_ROWS];
+                *to = (int8_t) MAX(MIN(*to + carry, 127), -128);
+            }
+
+        __m256i lo[3], hi[3], rgb_lo[3], rgb_hi[3];
+        for (size_t k = 0; k < 3; k++)
+        {
+            __m256i u1 = fs8_lane_up(e1[k]);
+            __m256i err_lo = _mm256_add_epi16(_mm256_maddubs_epi16(w73, _mm256_unpacklo_epi8(e1[k], u1)),
+                                              _mm256_maddubs_epi16(w51, _mm256_unpacklo_epi8(u2[k], u3[k])));
+            __m256i err_hi = _mm256_add_epi16(_mm256_maddubs_epi16(w73, _mm256_unpackhi_epi8(e1[k], u1)),
+                                              _mm256_maddubs_epi16(w51, _mm256_unpackhi_epi8(u2[k], u3[k])));
+            u3[k] = u2[k];
+            u2[k] = u1;
+
+            // Widen in the same in-lane order as the unpacks above.
+            __m256i in = _mm256_load_si256((__m256i*) &strip_input[k*color_size + c*FS8_ROWS]);
+            __m256i sign = _mm256_cmpgt_epi8(zero, in);
+            lo[k] = _mm256_add_epi16(_mm256_add_epi16(_mm256_unpacklo_epi8(in, sign), x80),
+                                     _mm256_srai_epi16(err_lo, 4));
+            hi[k] = _mm256_add_epi16(_mm256_add_epi16(_mm256_unpackhi_epi8(in, sign), x80),
+                                     _mm256_srai_epi16(err_hi, 4));
+            rgb_lo[k] = lo[k] = _mm256_min_epi16(_mm256_max_epi16(lo[k], zero), x255);
+            rgb_hi[k] = hi[k] = _mm256_min_epi16(_mm256_max_epi16(hi[k], zero), x255);
+        }
+
+        FindClosestColorsFromPalette(rgb_lo, palette, palette_time);
+        FindClosestColorsFromPalette(rgb_hi, palette, palette_time);
+
+        for (size_t k = 0; k < 3; k++)
+        {
+            __m256i err = _mm256_packs_epi16(_mm256_sub_epi16(lo[k], rgb_lo[k]), _mm256_sub_epi16(hi[k], rgb_hi[k]));
+            e3[k] = e2[k];
+            e2[k] = e1[k];
+            e1[k] = _mm256_and_si256(err, real);
+
+            __m256i out = _mm256_packs_epi16(_mm256_sub_epi16(rgb_lo[k], x80), _mm256_sub_epi16(rgb_hi[k], x80));
+            _mm256_store_si256((__m256i*) &strip_input[k*color_size + c*FS8_ROWS], out);
+        }
+        if (progress)
+            __atomic_store_n(&progress[i], c + 1, __ATOMIC_RELEASE);
+    }
+
+    TIMESTAMP(ts2);
+    time->dither_time += (ts2 - ts1) - (palette_time->search_time - searched) - (time->stall_time - stalled);
+    time->dither_units += width * FS8_ROWS;
+}
+
+/**
+ * Transposes a 32x32 block of bytes in place: each half of 16 rows is
+ * transposed within its 128-bit lanes by four rounds of byte interleaving,
+ * then the halves are stitched together with 128-bit swaps.
+ */
+static inline void transpose_32x32_epi8(__m256i m[32])
+{
+    for (size_t h = 0; h < 2; h++)
+    {
+        __m256i *a = &m[h*16];
+        for (size_t round = 0; round < 4; round++)
+        {
+            __m256i b[16];
+            for (size_t k = 0; k < 8; k++)
+            {
+                b[2*k] = _mm256_unpacklo_epi8(a[k], a[k+8]);
+                b[2*k+1] = _mm256_unpackhi_epi8(a[k], a[k+8]);
+            }
+            for (size_t k = 0; k < 16; k++)
+                a[k] = b[k];
+        }
+    }
+
+    for (size_t k = 0; k < 16; k++)
+    {
+        __m256i top = m[k], bottom = m[k+16];
+        m[k] = _mm256_permute2x128_si256(top, bottom, 0x20);
+        m[k+16] = _mm256_permute2x128_si256(top, bottom, 0x31);
+    }
+}
+
+/**
+ * Loads 32 pixels of a row starting at column col into one byte vector per
+ * channel, biased by -128. Pixels off either edge read as zero.
+ */
+static inline void fs8_load_row(const DTPixel *row, ptrdiff_t col, size_t width, __m256i out[3])
+{
+    __m256i lo[3], hi[3];
+    load_pixels16(row, col, width, lo);
+    load_pixels16(row, col + 16, width, hi);
+
+    __m256i real = _mm256_set1_epi8(-1);
+    if (col < 0 || col + 32 > (ptrdiff_t) width)
+    {
+        __attribute__((aligned(32))) int8_t mask[32];
+        for (ptrdiff_t k = 0; k < 32; k++)
+            mask[k] = (int8_t) ((col + k >= 0 && col + k < (ptrdiff_t) width) ? -1 : 0);
+        real = _mm256_load_si256((const __m256i*) mask);
+    }
+
+    const __m256i bias = _mm256_set1_epi8((char) 0x80);
+    for (size_t c = 0; c < 3; c++)
+    {
+        __m256i bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(lo[c], hi[c]), 0xD8);
+        out[c] = _mm256_and_si256(_mm256_xor_si256(bytes, bias), real);
+    }
+}
+
+/**
+ * Converts between the image and the byte layout, one 32-row strip at a
+ * time. As with shift_strip, 32 rows are loaded at a time, each offset by
+ * its skew, and transposed so that each row becomes a lane. Every lane of
+ * every column is written, positions off the image as zero, and those are
+ * never written back.
+ */
+static void fs8_shift(DTPixel *pixels, size_t width, size_t height, int8_t *shifted,
+                      size_t shifted_width, size_t color_size)
+{
+    size_t strips = (height + FS8_ROWS - 1) / FS8_ROWS;
+
+    #pragma omp parallel for schedule(static)
+    for (size_t s = 0; s < strips; s++)
+    {
+        int8_t *strip = &shifted[s*FS8_ROWS*shifted_width];
+        for (size_t x = 0; x < shifted_width; x += FS8_ROWS)
+        {
+            __m256i block[3][FS8_ROWS];
+
+            for (size_t r = 0; r < FS8_ROWS; r++)
+            {
+                size_t y = s*FS8_ROWS + r;
+                __m256i rgb[3] = { _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256() };
+                if (y < height)
+                    fs8_load_row(&pixels[y*width], (ptrdiff_t) x - (ptrdiff_t) (2*r), width, rgb);
+                for (size_t c = 0; c < 3; c++)
+                    block[c][r] = rgb[c];
+            }
+
+            size_t columns = MIN(FS8_ROWS, shifted_width - x);
+            for (size_t c = 0; c < 3; c++)
+            {
+                transpose_32x32_epi8(block[c]);
+                for (size_t t = 0; t < columns; t++)
+                    _mm256_store_si256((__m256i*) &strip[c*color_size + (x+t)*FS8_ROWS], block[c][t]);
+            }
+        }
+    }
+}
+
+static void fs8_deshift(DTPixel *pixels, size_t width, size_t height, const int8_t *shifted,
+                        size_t shifted_width, size_t color_size)
+{
+    size_t strips = (height + FS8_ROWS - 1) / FS8_ROWS;
+    const __m256i bias = _mm256_set1_epi8((char) 0x80);
+
+    #pragma omp parallel for schedule(static)
+    for (size_t s = 0; s < strips; s++)
+    {
+        const int8_t *strip = &shifted[s*FS8_ROWS*shifted_width];
+        size_t rows = MIN(FS8_ROWS, height - s*FS8_ROWS);
+
+        for (size_t x = 0; x < shifted_width; x += FS8_ROWS)
+        {
+            __m256i block[3][FS8_ROWS];
+
+            size_t columns = MIN(FS8_ROWS, shifted_width - x);
+            for (size_t c = 0; c < 3; c++)
+            {
+                for (size_t t = 0; t < FS8_ROWS; t++)
+                    block[c][t] = (t < columns)
+                        ? _mm256_load_si256((const __m256i*) &strip[c*color_size + (x+t)*FS8_ROWS])
+                        : _mm256_setzero_si256();
+                transpose_32x32_epi8(block[c]);
+            }
+
+            for (size_t r = 0; r < rows; r++)
+            {
+                DTPixel *row = &pixels[(s*FS8_ROWS + r)*width];
+                ptrdiff_t col = (ptrdiff_t) x - (ptrdiff_t) (2*r);
+                __m256i lo[3], hi[3];
+                for (size_t c = 0; c < 3; c++)
+                {
+                    __m256i bytes = _mm256_xor_si256(block[c][r], bias);
+                    lo[c] = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(bytes));
+                    hi[c] = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(bytes, 1));
+                }
+                store_pixels16(row, col, width, lo);
+                store_pixels16(row, col + 16, width, hi);
+            }
+        }
+    }
+}
+
+void
+ApplyFloydSteinbergDitherInt8(DTImage *image, DTPalettePacked *palette, palette_time_t *palette_time)
+{
+    dt_time_t t;
+    DTTimeInit(&t);
+
+    size_t width = image->width;
+    size_t height = image->height;
+
+    // Three columns past the last lane's last pixel, so that the carries of
+    // the final pixels of the last row are produced too.
+    size_t shifted_width = width + 2*(FS8_ROWS - 1) + 3;
+    size_t strips = (height + FS8_ROWS - 1) / FS8_ROWS;
+    size_t color_size = strips * FS8_ROWS * shifted_width;
+
+    int8_t *shifted = XMemalign(64, 3 * color_size);
+
+    unsigned long long ts1, ts2;
+    TIMESTAMP(ts1);
+    fs8_shift(image->pixels, width, height, shifted, shifted_width, color_size);
+    TIMESTAMP(ts2);
+    t.shift_time += (ts2 - ts1);
+    t.shift_units += width * height;
+
+    size_t *progress = XCalloc(MAX(strips, 1), sizeof(size_t));
+
+    TIMESTAMP(ts1);
+    #pragma omp parallel
+    {
+        dt_time_t local_time;
+        palette_time_t local_palette_time;
+        DTTimeInit(&local_time);
+        PaletteTimeInit(&local_palette_time);
+
+        #pragma omp for schedule(static, 1)
+        for (size_t i = 0; i < strips; i++)
+        {
+            int8_t *strip = &shifted[i*FS8_ROWS*shifted_width];
+            fs8_strip(strip, (i + 1 < strips) ? strip + FS8_ROWS*shifted_width : NULL, shifted_width,
+                      color_size, width, MIN(FS8_ROWS, height - i*FS8_ROWS), i, progress,
+                      palette, &local_time, &local_palette_time);
+        }
+
+        #pragma omp critical
+        {
+            DTTimeAdd(&t, &local_time);
+            PaletteTimeAdd(palette_time, &local_palette_time);
+            t.threads++;
+        }
+    }
+    TIMESTAMP(ts2);
+    t.wave_time += (ts2 - ts1);
+    t.wave_units += strips * FS8_ROWS * shifted_width;
+
+    TIMESTAMP(ts1);
+    fs8_deshift(image->pixels, width, height, shifted, shifted_width, color_size);
+    TIMESTAMP(ts2);
+    t.deshift_time += (ts2 - ts1);
+    t.deshift_units += width * height;
+
+    DTTimeReport(&t);
+
+    XFree(progress);
+    XFree(shifted);
+}
+
+void
+ApplyErrorDiffusionDither(DTImage *image, DTPalettePacked *palette, DTDiffusionMatrix matrix,
+                          int serpentine, palette_time_t *palette_time)
+{
+    if (matrix == DT_DIFFUSION_FLOYD_STEINBERG)
+    {
+        ApplyFloydSteinbergDither(image, palette, serpentine, palette_time);
+        return;
+    }
+
+    dt_time_t t;
+    DTTimeInit(&t);
+
+    const ed_matrix_t *m = ed_specializations[matrix].matrix;
+    size_t skew = ed_skew(m);
+    size_t pad = ed_pad(m);
+
+    size_t width = image->width;
+    size_t height = image->height;
+
+    // The last row of a strip carries into the next one from columns up to
+    // skew*depth past its last pixel, so those columns must exist too.
+    size_t reach = (height <= 16) ? height - 1 : 16 - 1 + ed_depth(m);
+    size_t shifted_width = pad + width + skew*reach;
+    size_t shifted_height = (height / 16) * 16 + (height % 16 > 0) * 16;
+    size_t color_size = shifted_width * shifted_height;
+    size_t memory_size = 3 * color_size * sizeof(int16_t);
+
+    int16_t *shifted_memory = XMemalign(64, memory_size);
+    shift_memory(image->pixels, shifted_memory, width, height,
+                 shifted_width, shifted_height, skew, pad, serpentine, &t);
+
+    // The pad columns must read as zero error, so the output starts cleared.
+    int16_t *shifted_output = XMemalign(64, memory_size);
+    memset(shifted_output, 0, memory_size);
+
+    ed_runner(ed_specializations[matrix].strip, shifted_memory, shifted_output,
+              shifted_width, shifted_height, width, serpentine, palette, &t, palette_time);
+    deshift_memory(image->pixels, shifted_output, width, height,
+                   shifted_width, shifted_height, skew, pad, serpentine, &t);
+
+    DTTimeReport(&t);
+
+    XFree(shifted_memory);
+    XFree(shifted_output);
+}
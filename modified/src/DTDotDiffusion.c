@@ -0,0 +1,261 @@
+/*
+ *  DTDotDiffusion.c
+ *  dither Utility
+ *
+ *  Knuth's dot diffusion.
+ *
+ */
+
+#include <DTDither.h>
+#include <UtilMacro.h>
+#include <XMalloc.h>
+
+#include <stdint.h>
+#include <immintrin.h>
+
+#include <string.h>
+
+/*
+ * Every pixel takes the class of its position in the 8x8 class matrix, tiled
+ * over the image. Classes are processed in increasing order, and a pixel's
+ * error goes to its eight neighbours of a higher class only, orthogonal ones
+ * weighing twice the diagonal ones. Pixels of one class are 8 apart, so their
+ * neighbourhoods never overlap: a whole class is one independent wave.
+ *
+ * The image is stored class-major: plane k holds, for every 8x8 block, the
+ * pixel of class k in it. A wave then runs over contiguous vectors of 16
+ * blocks, and the neighbour of class m one block over is the same vector in
+ * plane m, offset by one row or column of blocks. Planes carry a border of
+ * one block on every side to catch the error sent off the image.
+ */
+#define DD_SIZE 8
+#define DD_CLASSES (DD_SIZE * DD_SIZE)
+
+// Knuth's class matrix, from "Digital halftones by dot diffusion" (1987).
+static const uint8_t dd_class[DD_SIZE][DD_SIZE] = {
+    { 34, 48, 40, 32, 29, 15, 23, 31 },
+    { 42, 58, 56, 53, 21,  5,  7, 10 },
+    { 50, 62, 61, 45, 13,  1,  2, 18 },
+    { 38, 46, 54, 37, 25, 17,  9, 26 },
+    { 28, 14, 22, 30, 35, 49, 41, 33 },
+    { 20,  4,  6, 11, 43, 59, 57, 52 },
+    { 12,  0,  3, 19, 51, 63, 60, 44 },
+    { 24, 16,  8, 27, 39, 47, 55, 36 },
+};
+
+// Fixed-point bits of the diffusion weights; err * weight must fit in int16.
+#define DD_WEIGHT_BITS 7
+
+/*
+ * A neighbour receiving error from class k: its class, the offset of its
+ * block in plane elements, and its share of the error in DD_WEIGHT_BITS fixed
+ * point.
+ */
+typedef struct {
+    size_t plane;
+    ptrdiff_t offset;
+    int16_t weight;
+} dd_tap_t;
+
+typedef struct {
+    size_t count;
+    dd_tap_t tap[8];
+} dd_taps_t;
+
+/// @brief Builds the neighbours of every class for planes of the given stride.
+static void dd_build_taps(dd_taps_t *taps, size_t stride)
+{
+    for (size_t r = 0; r < DD_SIZE; r++)
+    {
+        for (size_t c = 0; c < DD_SIZE; c++)
+        {
+            size_t k = dd_class[r][c];
+            int total = 0;
+            taps[k].count = 0;
+
+            for (int dr = -1; dr <= 1; dr++)
+            {
+                for (int dc = -1; dc <= 1; dc++)
+                {
+                    int nr = (int) r + dr, nc = (int) c + dc;
+                    size_t m = dd_class[(nr + DD_SIZE) % DD_SIZE][(nc + DD_SIZE) % DD_SIZE];
+                    if ((dr == 0 && dc == 0) || m <= k)
+                        continue;
+
+                    ptrdiff_t by = (nr < 0) ? -1 : (nr >= DD_SIZE);
+                    ptrdiff_t bx = (nc < 0) ? -1 : (nc >= DD_SIZE);
+                    int w = (dr == 0 || dc == 0) ? 2 : 1;
+
+                    taps[k].tap[taps[k].count++] = (dd_tap_t) { m, by*(ptrdiff_t) stride + bx, (int16_t) w };
+                    total += w;
+                }
+            }
+
+            // Rescale to fixed point; a class with no higher neighbour drops its error.
+            for (size_t t = 0; t < taps[k].count; t++)
+                taps[k].tap[t].weight = (int16_t) ((taps[k].tap[t].weight << DD_WEIGHT_BITS) / total);
+        }
+    }
+}
+
+/**
+ * Moves pixels between the image and the class-major planes. Each image row
+ * is read once per column of the class matrix, with a stride of DD_SIZE
+ * pixels, so that every plane row is written sequentially. Positions of the
+ * planes off the image are left alone, so their mask stays clear.
+ */
+static void dd_shift(DTImage *image, int16_t *planes, int16_t *mask, size_t stride, size_t plane_size,
+                     size_t color_size)
+{
+    #pragma omp parallel for schedule(static)
+    for (size_t y = 0; y < image->height; y++)
+    {
+        const DTPixel *row = &image->pixels[y*image->width];
+        for (size_t c = 0; c < MIN(DD_SIZE, image->width); c++)
+        {
+            size_t i = dd_class[y % DD_SIZE][c]*plane_size + (y/DD_SIZE + 1)*stride + 1;
+            for (size_t x = c; x < image->width; x += DD_SIZE, i++)
+            {
+                planes[0*color_size + i] = row[x].r;
+                planes[1*color_size + i] = row[x].g;
+                planes[2*color_size + i] = row[x].b;
+                mask[i] = -1;
+            }
+        }
+    }
+}
+
+static void dd_deshift(DTImage *image, int16_t *planes, size_t stride, size_t plane_size, size_t color_size)
+{
+    #pragma omp parallel for schedule(static)
+    for (size_t y = 0; y < image->height; y++)
+    {
+        DTPixel *row = &image->pixels[y*image->width];
+        for (size_t c = 0; c < MIN(DD_SIZE, image->width); c++)
+        {
+            size_t i = dd_class[y % DD_SIZE][c]*plane_size + (y/DD_SIZE + 1)*stride + 1;
+            for (size_t x = c; x < image->width; x += DD_SIZE, i++)
+            {
+                row[x].r = (byte) planes[0*color_size + i];
+                row[x].g = (byte) planes[1*color_size + i];
+                row[x].b = (byte) planes[2*color_size + i];
+            }
+        }
+    }
+}
+
+/**
+ * Dithers 16 blocks of class k starting at plane element i: each pixel, with
+ * the error it has received, is clamped and searched, its color stored in
+ * place and its error added into its higher-class neighbours. Positions off
+ * the image have a clear mask, so they send no error.
+ */
+static inline void dd_kernel(int16_t *planes, const int16_t *mask, size_t plane_size, size_t color_size,
+                             size_t k, size_t i, const dd_taps_t *taps, DTPalettePacked *palette,
+                             dt_time_t *time, palette_time_t *palette_time)
+{
+    unsigned long long ts1, ts2;
+    __m256i value[3], rgb[3];
+    int16_t *at = &planes[k*plane_size + i];
+
+    TIMESTAMP(ts1);
+    for (size_t c = 0; c < 3; c++)
+    {
+        __m256i v = _mm256_loadu_si256((__m256i*) &at[c*color_size]);
+        value[c] = _mm256_min_epi16(_mm256_max_epi16(v, _mm256_setzero_si256()), _mm256_set1_epi16(255));
+        rgb[c] = value[c];
+    }
+    TIMESTAMP(ts2);
+    time->dither_time += (ts2 - ts1);
+
+    FindClosestColorsFromPalette(rgb, palette, palette_time);
+
+    TIMESTAMP(ts1);
+    __m256i valid = _mm256_loadu_si256((__m256i*) &mask[k*plane_size + i]);
+    for (size_t c = 0; c < 3; c++)
+    {
+        __m256i error = _mm256_and_si256(_mm256_sub_epi16(value[c], rgb[c]), valid);
+        _mm256_storeu_si256((__m256i*) &at[c*color_size], rgb[c]);
+
+        for (size_t t = 0; t < taps->count; t++)
+        {
+            const dd_tap_t *tap = &taps->tap[t];
+            int16_t *to = &planes[c*color_size + tap->plane*plane_size + (ptrdiff_t) i + tap->offset];
+            __m256i share = _mm256_srai_epi16(_mm256_mullo_epi16(error, _mm256_set1_epi16(tap->weight)),
+                                              DD_WEIGHT_BITS);
+            _mm256_storeu_si256((__m256i*) to, _mm256_add_epi16(_mm256_loadu_si256((__m256i*) to), share));
+        }
+    }
+    TIMESTAMP(ts2);
+    time->dither_time += (ts2 - ts1);
+    time->dither_units += 16;
+}
+
+void
+ApplyDotDiffusionDither(DTImage *image, DTPalettePacked *palette, palette_time_t *palette_time)
+{
+    dt_time_t t;
+    DTTimeInit(&t);
+
+    // Blocks per row and column, and the plane geometry around them.
+    size_t blocks_x = (image->width + DD_SIZE - 1) / DD_SIZE;
+    size_t blocks_y = (image->height + DD_SIZE - 1) / DD_SIZE;
+    size_t stride = ((blocks_x + 15) / 16) * 16 + 16;
+    size_t plane_size = (blocks_y + 2) * stride;
+    size_t color_size = DD_CLASSES * plane_size;
+
+    dd_taps_t taps[DD_CLASSES];
+    dd_build_taps(taps, stride);
+
+    int16_t *planes = XCalloc(3 * color_size, sizeof(int16_t));
+    int16_t *mask = XCalloc(color_size, sizeof(int16_t));
+
+    unsigned long long ts1, ts2, ws1, ws2;
+
+    TIMESTAMP(ts1);
+    dd_shift(image, planes, mask, stride, plane_size, color_size);
+    TIMESTAMP(ts2);
+    t.shift_time += (ts2 - ts1);
+    t.shift_units += image->width * image->height;
+
+    TIMESTAMP(ws1);
+    #pragma omp parallel
+    {
+        dt_time_t local_time;
+        palette_time_t local_palette_time;
+        DTTimeInit(&local_time);
+        PaletteTimeInit(&local_palette_time);
+
+        // The implicit barrier of each loop separates the class waves.
+        for (size_t k = 0; k < DD_CLASSES; k++)
+        {
+            #pragma omp for schedule(static)
+            for (size_t by = 0; by < blocks_y; by++)
+                for (size_t bx = 0; bx < blocks_x; bx += 16)
+                    dd_kernel(planes, mask, plane_size, color_size, k, (by + 1)*stride + bx + 1,
+                              &taps[k], palette, &local_time, &local_palette_time);
+        }
+
+        #pragma omp critical
+        {
+            t.dither_time += local_time.dither_time;
+            t.dither_units += local_time.dither_units;
+            PaletteTimeAdd(palette_time, &local_palette_time);
+            t.threads++;
+        }
+    }
+    TIMESTAMP(ws2);
+    t.wave_time += (ws2 - ws1);
+    t.wave_units += image->width * image->height;
+
+    TIMESTAMP(ts1);
+    dd_deshift(image, planes, stride, plane_size, color_size);
+    TIMESTAMP(ts2);
+    t.deshift_time += (ts2 - ts1);
+    t.deshift_units += image->width * image->height;
+
+    DTTimeReport(&t);
+
+    XFree(planes);
+    XFree(mask);
+}
@@ -10,6 +10,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <immintrin.h>
 #include <DTImage.h>
 #include <XMalloc.h>
 #include <png.h>
@@ -46,6 +47,8 @@ CreateImageFromFile(char *filename)
     /* initialize image and read pixels */
     DTImage *image = XMalloc(sizeof(DTImage));
     image->type = type;
+    image->pixels = NULL;
+    image->gray = NULL;
     if (ReadDataFromFile(image, file)) {
         free(image);
         fprintf(stderr, "Failed to read image content.\n");
@@ -86,13 +89,13 @@ WriteImageToFile(DTImage *img, char *filename)
 
         png_init_io(png, file);
 
-        /* output in 8-bit RGB */
+        /* output in 8-bit RGB, or grey for single-channel images */
         png_set_IHDR(
             png,
             info,
             (png_uint_32) img->width, (png_uint_32) img->height,
             8,
-            PNG_COLOR_TYPE_RGB,
+            img->gray ? PNG_COLOR_TYPE_GRAY : PNG_COLOR_TYPE_RGB,
             PNG_INTERLACE_NONE,
             PNG_COMPRESSION_TYPE_DEFAULT,
             PNG_FILTER_TYPE_DEFAULT
@@ -110,8 +113,11 @@ WriteImageToFile(DTImage *img, char *filename)
     } else {
         /* PPM */
         fprintf(file, "P6\n%zu %zu\n255\n", img->width, img->height);
-        for (size_t i = 0; i < img->resolution; i++)
-            fwrite(&img->pixels[i], sizeof(DTPixel), 1, file);
+        for (size_t i = 0; i < img->resolution; i++) {
+            DTPixel pixel = img->gray ?
+                PixelFromRGB(img->gray[i], img->gray[i], img->gray[i]) : img->pixels[i];
+            fwrite(&pixel, sizeof(DTPixel), 1, file);
+        }
     }
 
     fclose(file);
@@ -184,16 +190,19 @@ ReadDataFromFile(DTImage *img, FILE *file)
         if (color_type & PNG_COLOR_MASK_ALPHA)
             png_set_strip_alpha(png);
 
-        if (color_type == PNG_COLOR_TYPE_GRAY ||
-            color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
-            png_set_gray_to_rgb(png);
+        /* grey is kept as a single channel rather than expanded */
+        int gray = color_type == PNG_COLOR_TYPE_GRAY ||
+                   color_type == PNG_COLOR_TYPE_GRAY_ALPHA;
 
         png_read_update_info(png, info);
 
-        img->pixels = malloc(sizeof(DTPixel) * img->width * img->height);
+        if (gray)
+            img->gray = malloc(img->width * img->height);
+        else
+            img->pixels = malloc(sizeof(DTPixel) * img->width * img->height);
 
-        /* check if data is realy 8-bit RGB */
-        if (png_get_rowbytes(png, info) != img->width * sizeof(DTPixel))
+        /* check if data is realy 8-bit RGB (or grey) */
+        if (png_get_rowbytes(png, info) != img->width * (gray ? 1 : sizeof(DTPixel)))
             return 4;
 
         png_bytep *rowPointers = PNGRowPointersForImage(img);
@@ -208,6 +217,85 @@ ReadDataFromFile(DTImage *img, FILE *file)
     return 0;
 }
 
+/*
+ * Byte k of a packed row belongs to a grey pixel when it equals byte k+1 for
+ * the first two channels of the pixel. Three vectors cover 32 whole pixels;
+ * these masks select, in each of them, the bytes to compare.
+ */
+__attribute__((aligned(32))) static const byte gray_check_mask[3][32] = {
+    { 255, 255, 0, 255, 255, 0, 255, 255, 0, 255, 255, 0, 255, 255, 0, 255,
+      255, 0, 255, 255, 0, 255, 255, 0, 255, 255, 0, 255, 255, 0, 255, 255 },
+    { 0, 255, 255, 0, 255, 255, 0, 255, 255, 0, 255, 255, 0, 255, 255, 0,
+      255, 255, 0, 255, 255, 0, 255, 255, 0, 255, 255, 0, 255, 255, 0, 255 },
+    { 255, 0, 255, 255, 0, 255, 255, 0, 255, 255, 0, 255, 255, 0, 255, 255,
+      0, 255, 255, 0, 255, 255, 0, 255, 255, 0, 255, 255, 0, 255, 255, 0 }
+};
+
+/* returns non-zero if every pixel has r = g = b */
+static int
+ImageIsGray(DTImage *img)
+{
+    const byte *bytes = (const byte *) img->pixels;
+    size_t size = img->resolution * sizeof(DTPixel);
+    size_t i = 0;
+
+    /* the shifted load reads one byte past each block, so stop one early */
+    for (; i + 3*32 < size; i += 3*32) {
+        __m256i diff = _mm256_setzero_si256();
+        for (size_t v = 0; v < 3; v++) {
+            __m256i a = _mm256_loadu_si256((const __m256i*) &bytes[i + 32*v]);
+            __m256i b = _mm256_loadu_si256((const __m256i*) &bytes[i + 32*v + 1]);
+            __m256i m = _mm256_load_si256((const __m256i*) gray_check_mask[v]);
+            diff = _mm256_or_si256(diff, _mm256_and_si256(_mm256_xor_si256(a, b), m));
+        }
+        if (!_mm256_testz_si256(diff, diff))
+            return 0;
+    }
+
+    for (size_t p = i / sizeof(DTPixel); p < img->resolution; p++) {
+        DTPixel px = img->pixels[p];
+        if (px.r != px.g || px.g != px.b)
+            return 0;
+    }
+
+    return 1;
+}
+
+/* returns non-zero if the image is grey, keeping it as a single channel */
+int
+ImageConvertToGray(DTImage *img)
+{
+    if (img->gray)
+        return 1;
+    if (!ImageIsGray(img))
+        return 0;
+
+    img->gray = malloc(img->resolution);
+    #pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < img->resolution; i++)
+        img->gray[i] = img->pixels[i].r;
+
+    free(img->pixels);
+    img->pixels = NULL;
+    return 1;
+}
+
+/* expands a single-channel image back to packed RGB */
+void
+ImageConvertToRGB(DTImage *img)
+{
+    if (img->pixels)
+        return;
+
+    img->pixels = malloc(sizeof(DTPixel) * img->resolution);
+    #pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < img->resolution; i++)
+        img->pixels[i] = PixelFromRGB(img->gray[i], img->gray[i], img->gray[i]);
+
+    free(img->gray);
+    img->gray = NULL;
+}
+
 DTImageType
 IdentifyImageType(char *header)
 {
@@ -226,10 +314,11 @@ png_bytep *
 PNGRowPointersForImage(DTImage *img)
 {
     png_bytep *rowPointers = malloc(sizeof(png_bytep) * img->height);
-    png_size_t rowSize = img->width * sizeof(DTPixel);
+    png_bytep data = img->gray ? (png_bytep)img->gray : (png_bytep)img->pixels;
+    png_size_t rowSize = img->width * (img->gray ? 1 : sizeof(DTPixel));
 
     for (size_t i = 0; i < img->height; i++)
-        rowPointers[i] = (png_bytep)img->pixels + rowSize * i;
+        rowPointers[i] = data + rowSize * i;
 
     return rowPointers;
 }
@@ -0,0 +1,600 @@
+/*
+ *  DTOrdered.c
+ *  dither Utility
+ *
+ *  Ordered (threshold mask) dithering implementation: Bayer matrices,
+ *  void-and-cluster blue noise and pattern dithering with mixing plans.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <DTDither.h>
+#include <DTPixelPack.h>
+#include <UtilMacro.h>
+#include <XMalloc.h>
+
+#include <stdint.h>
+#include <immintrin.h>
+#include <math.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define BAYER_MAX 16
+
+/**
+ * Fills matrix with the size x size Bayer index matrix (size a power of two
+ * up to BAYER_MAX), built by recursively splitting each cell into the
+ * 2x2 pattern {0, 2; 3, 1}.
+ */
+static void bayer_matrix(size_t size, uint16_t *matrix)
+{
+    matrix[0] = 0;
+    for (size_t n = 1; n < size; n *= 2)
+    {
+        for (size_t y = 0; y < n; y++)
+        {
+            for (size_t x = 0; x < n; x++)
+            {
+                uint16_t m = 4 * matrix[y*size + x];
+                matrix[y*size + x] = m;
+                matrix[y*size + x+n] = m + 2;
+                matrix[(y+n)*size + x] = m + 3;
+                matrix[(y+n)*size + x+n] = m + 1;
+            }
+        }
+    }
+}
+
+/**
+ * Estimates, per channel, the distance between neighbouring palette levels,
+ * which is how far the threshold has to push a pixel to reach the next color.
+ * Grey palettes have one level per color; other palettes are treated as a
+ * cube, with about cbrt(size) levels along each axis.
+ */
+static void ordered_spread(DTPalettePacked *palette, double spread[3])
+{
+    int grey = 1;
+    for (size_t i = 0; i < palette->size; i++)
+    {
+        int r = palette->colors[i];
+        grey &= (r == palette->colors[palette->stride + i]) &&
+                (r == palette->colors[2*palette->stride + i]);
+    }
+
+    for (size_t k = 0; k < 3; k++)
+    {
+        uint8_t seen[256] = {0};
+        int lo = 255, hi = 0;
+        size_t distinct = 0;
+        for (size_t i = 0; i < palette->size; i++)
+        {
+            int v = palette->colors[k*palette->stride + i];
+            distinct += !seen[v];
+            seen[v] = 1;
+            lo = MIN(lo, v);
+            hi = MAX(hi, v);
+        }
+
+        double levels = grey ? (double) distinct
+                             : MIN((double) distinct, MAX(2.0, round(cbrt((double) palette->size))));
+        spread[k] = (levels > 1) ? (hi - lo) / (levels - 1) : 255.0;
+    }
+}
+
+/**
+ * Dithers the image against a tileable size x size mask of threshold ranks
+ * (a permutation of 0 .. size*size-1, row-major). size must be a power of
+ * two, so that it either divides 16 or is a multiple of it.
+ */
+static void
+threshold_dither(DTImage *image, DTPalettePacked *palette, const uint16_t *mask, size_t mask_size,
+                 palette_time_t *palette_time)
+{
+    dt_time_t t;
+    DTTimeInit(&t);
+
+    double spread[3];
+    ordered_spread(palette, spread);
+
+    // Per-row bias vectors, with the mask tiled out to at least 16 columns so
+    // that a vector starting at any multiple of 16 reads a contiguous run.
+    const size_t bias_width = MAX(16, mask_size);
+    int16_t *bias = XMemalign(32, mask_size * 3 * bias_width * sizeof(int16_t));
+    const double cells = (double) (mask_size * mask_size);
+    for (size_t y = 0; y < mask_size; y++)
+        for (size_t k = 0; k < 3; k++)
+            for (size_t x = 0; x < bias_width; x++)
+            {
+                double threshold = (mask[y*mask_size + x % mask_size] + 0.5) / cells - 0.5;
+                bias[(y*3 + k)*bias_width + x] = (int16_t) lrint(threshold * spread[k]);
+            }
+
+    size_t width = image->width;
+    size_t height = image->height;
+
+    unsigned long long ws1, ws2;
+    TIMESTAMP(ws1);
+
+    #pragma omp parallel
+    {
+        dt_time_t local_time;
+        palette_time_t local_palette_time;
+        DTTimeInit(&local_time);
+        PaletteTimeInit(&local_palette_time);
+
+        unsigned long long ts1, ts2;
+        TIMESTAMP(ts1);
+
+        // Every row is independent: bias, clamp and search 16 pixels at a time.
+        #pragma omp for schedule(static)
+        for (size_t i = 0; i < height; i++)
+        {
+            DTPixel *row = &image->pixels[i*width];
+            const int16_t *row_bias = &bias[(i % mask_size)*3*bias_width];
+
+            for (size_t j = 0; j < width; j += 16)
+            {
+                __m256i rgb[3];
+                load_pixels16(row, (ptrdiff_t) j, width, rgb);
+                for (size_t k = 0; k < 3; k++)
+                {
+                    const int16_t *b = &row_bias[k*bias_width + (j % bias_width)];
+                    __m256i v = _mm256_add_epi16(rgb[k], _mm256_load_si256((const __m256i*) b));
+                    rgb[k] = _mm256_min_epi16(_mm256_max_epi16(v, _mm256_setzero_si256()),
+                                              _mm256_set1_epi16(255));
+                }
+                FindClosestColorsFromPalette(rgb, palette, &local_palette_time);
+                store_pixels16(row, (ptrdiff_t) j, width, rgb);
+            }
+        }
+
+        TIMESTAMP(ts2);
+        local_time.dither_time += (ts2 - ts1);
+
+        #pragma omp critical
+        {
+            t.dither_time += local_time.dither_time;
+            PaletteTimeAdd(palette_time, &local_palette_time);
+            t.threads++;
+        }
+    }
+
+    TIMESTAMP(ws2);
+    t.dither_units = width * height;
+    t.wave_time = (ws2 - ws1);
+    t.wave_units = width * height;
+
+    DTTimeReport(&t);
+
+    XFree(bias);
+}
+
+#define BLUE_NOISE_SIGMA 1.5
+#define BLUE_NOISE_SEED 0x9E3779B97F4A7C15ull
+
+/// @brief Adds sign times the toroidal gaussian centered on pixel p to energy.
+static void vc_splat(double *energy, const double *gauss, size_t size, size_t p, double sign)
+{
+    const size_t py = p / size, px = p % size;
+    for (size_t y = 0; y < size; y++)
+    {
+        const double *g = &gauss[((y + size - py) & (size - 1)) * size];
+        double *e = &energy[y*size];
+        for (size_t x = 0; x < size; x++)
+            e[x] += sign * g[(x + size - px) & (size - 1)];
+    }
+}
+
+/// @brief Finds the set pixel of highest energy (the tightest cluster).
+static size_t vc_cluster(const double *energy, const uint8_t *bits, size_t n)
+{
+    size_t best = n;
+    for (size_t i = 0; i < n; i++)
+        if (bits[i] && (best == n || energy[i] > energy[best]))
+            best = i;
+    return best;
+}
+
+/// @brief Finds the unset pixel of lowest energy (the largest void).
+static size_t vc_void(const double *energy, const uint8_t *bits, size_t n)
+{
+    size_t best = n;
+    for (size_t i = 0; i < n; i++)
+        if (!bits[i] && (best == n || energy[i] < energy[best]))
+            best = i;
+    return best;
+}
+
+/**
+ * Generates a size x size tileable blue-noise rank mask with Ulichney's
+ * void-and-cluster method. A sparse random pattern is first relaxed by moving
+ * its tightest cluster into its largest void until they coincide. Its pixels
+ * are then ranked by repeatedly removing the tightest cluster, and the rest
+ * by repeatedly filling the largest void. Energy is a toroidal gaussian, so
+ * the mask tiles without seams. The seed is fixed, so the mask is always the
+ * same.
+ */
+static uint16_t *blue_noise_generate(size_t size)
+{
+    const size_t n = size * size;
+    uint16_t *mask = XMalloc(n * sizeof(uint16_t));
+    double *gauss = XMalloc(n * sizeof(double));
+    double *energy = XCalloc(n, sizeof(double));
+    double *work_energy = XMalloc(n * sizeof(double));
+    uint8_t *bits = XCalloc(n, sizeof(uint8_t));
+    uint8_t *work_bits = XMalloc(n * sizeof(uint8_t));
+
+    for (size_t y = 0; y < size; y++)
+        for (size_t x = 0; x < size; x++)
+        {
+            double dy = (double) MIN(y, size - y), dx = (double) MIN(x, size - x);
+            gauss[y*size + x] = exp(-(dx*dx + dy*dy) / (2 * BLUE_NOISE_SIGMA * BLUE_NOISE_SIGMA));
+        }
+
+    // Initial pattern: a tenth of the pixels, chosen by xorshift.
+    const size_t ones = n / 10;
+    uint64_t state = BLUE_NOISE_SEED;
+    for (size_t placed = 0; placed < ones; )
+    {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        size_t p = (size_t) (state % n);
+        if (bits[p])
+            continue;
+        bits[p] = 1;
+        vc_splat(energy, gauss, size, p, 1);
+        placed++;
+    }
+
+    for (size_t iter = 0; iter < n; iter++)
+    {
+        size_t cluster = vc_cluster(energy, bits, n);
+        bits[cluster] = 0;
+        vc_splat(energy, gauss, size, cluster, -1);
+
+        size_t hole = vc_void(energy, bits, n);
+        bits[hole] = 1;
+        vc_splat(energy, gauss, size, hole, 1);
+
+        if (hole == cluster)
+            break;
+    }
+
+    // Rank the initial pattern's pixels from the top down.
+    memcpy(work_bits, bits, n * sizeof(uint8_t));
+    memcpy(work_energy, energy, n * sizeof(double));
+    for (size_t rank = ones; rank-- > 0; )
+    {
+        size_t cluster = vc_cluster(work_energy, work_bits, n);
+        work_bits[cluster] = 0;
+        vc_splat(work_energy, gauss, size, cluster, -1);
+        mask[cluster] = (uint16_t) rank;
+    }
+
+    // Rank everything else from the bottom up.
+    for (size_t rank = ones; rank < n; rank++)
+    {
+        size_t hole = vc_void(energy, bits, n);
+        bits[hole] = 1;
+        vc_splat(energy, gauss, size, hole, 1);
+        mask[hole] = (uint16_t) rank;
+    }
+
+    XFree(gauss);
+    XFree(energy);
+    XFree(work_energy);
+    XFree(bits);
+    XFree(work_bits);
+
+    return mask;
+}
+
+/**
+ * Builds the cache file path for a mask of the given size, creating the cache
+ * directory ($XDG_CACHE_HOME/dither, or ~/.cache/dither) if needed. Returns 0
+ * when there is nowhere to cache.
+ */
+static int blue_noise_cache_path(size_t size, char *path, size_t len)
+{
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    char dir[4096];
+
+    if (xdg && *xdg)
+        snprintf(dir, sizeof(dir), "%s", xdg);
+    else if (home && *home)
+        snprintf(dir, sizeof(dir), "%s/.cache", home);
+    else
+        return 0;
+
+    mkdir(dir, 0755);
+    size_t end = strlen(dir);
+    snprintf(dir + end, sizeof(dir) - end, "/dither");
+    mkdir(dir, 0755);
+
+    int written = snprintf(path, len, "%s/bluenoise-%zu.pgm", dir, size);
+    return written > 0 && (size_t) written < len;
+}
+
+/**
+ * Reads a cached mask, stored as a 16-bit binary PGM of ranks. Anything that
+ * is not a full permutation of the right size is rejected.
+ */
+static uint16_t *blue_noise_load(const char *path, size_t size)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return NULL;
+
+    const size_t n = size * size;
+    size_t w, h;
+    unsigned long maxval;
+    uint16_t *mask = NULL;
+
+    if (fscanf(file, "P5 %zu %zu %lu", &w, &h, &maxval) == 3 && fgetc(file) != EOF
+        && w == size && h == size && maxval == n - 1)
+    {
+        uint8_t *raw = XMalloc(2 * n);
+        uint8_t *seen = XCalloc(n, sizeof(uint8_t));
+        int ok = fread(raw, 2, n, file) == n;
+
+        mask = XMalloc(n * sizeof(uint16_t));
+        for (size_t i = 0; ok && i < n; i++)
+        {
+            mask[i] = (uint16_t) ((raw[2*i] << 8) | raw[2*i + 1]);
+            ok = mask[i] < n && !seen[mask[i]];
+            seen[mask[i] % n] = 1;
+        }
+
+        if (!ok)
+        {
+            XFree(mask);
+            mask = NULL;
+        }
+        XFree(raw);
+        XFree(seen);
+    }
+
+    fclose(file);
+    return mask;
+}
+
+/// @brief Writes a mask to the cache, through a rename so readers never see a partial file.
+static void blue_noise_store(const char *path, const uint16_t *mask, size_t size)
+{
+    char tmp[4096 + 32];
+    snprintf(tmp, sizeof(tmp), "%s.%ld", path, (long) getpid());
+
+    FILE *file = fopen(tmp, "wb");
+    if (file == NULL)
+        return;
+
+    const size_t n = size * size;
+    int ok = fprintf(file, "P5\n%zu %zu\n%zu\n", size, size, n - 1) > 0;
+    for (size_t i = 0; ok && i < n; i++)
+        ok = fputc(mask[i] >> 8, file) != EOF && fputc(mask[i] & 0xFF, file) != EOF;
+
+    if (fclose(file) == 0 && ok)
+        rename(tmp, path);
+    else
+        remove(tmp);
+}
+
+/*
+ * Pattern dithering. Rather than biasing every pixel by its threshold, each
+ * input color gets a mixing plan: PATTERN_PLAN palette colors whose average
+ * approximates it, sorted by luminance. A pixel then takes the plan entry
+ * picked by its Bayer threshold, so the palette does not need to be a regular
+ * cube for the mix to come out right.
+ *
+ * Plans are built with Knoll's method, as described by Yliluoma: each entry
+ * is the palette color closest to the input plus the error accumulated by the
+ * previous entries. Input colors are quantized to PATTERN_BITS per channel,
+ * and only the cells that occur in the image get a plan.
+ */
+#define PATTERN_BITS 5
+#define PATTERN_CELLS (1u << (3*PATTERN_BITS))
+#define PATTERN_PLAN 16
+#define PATTERN_MATRIX 8
+
+static inline size_t pattern_cell(DTPixel px)
+{
+    const unsigned shift = 8 - PATTERN_BITS;
+    return ((size_t)(px.r >> shift) << (2*PATTERN_BITS)) |
+           ((size_t)(px.g >> shift) << PATTERN_BITS) |
+           (size_t)(px.b >> shift);
+}
+
+static inline int pattern_luma(DTPixel px)
+{
+    return 299*px.r + 587*px.g + 114*px.b;
+}
+
+/**
+ * Builds the plans for 16 cells at once, one per lane: every plan entry is a
+ * single batched palette search. The plans are then sorted by luminance.
+ */
+static void pattern_plans16(const uint32_t *cells, size_t count, DTPixel *plans, DTPalettePacked *palette,
+                            palette_time_t *palette_time)
+{
+    const unsigned shift = 8 - PATTERN_BITS;
+    const unsigned mask = (1u << PATTERN_BITS) - 1;
+    __attribute__((aligned(32))) int16_t lanes[3][16];
+    __m256i target[3], error[3];
+
+    // Lanes past count repeat the last cell; their plans are not stored.
+    for (size_t l = 0; l < 16; l++)
+    {
+        uint32_t cell = cells[MIN(l, count - 1)];
+        for (size_t c = 0; c < 3; c++)
+            lanes[c][l] = (int16_t) ((((cell >> ((2 - c)*PATTERN_BITS)) & mask) << shift) | (1u << (shift - 1)));
+    }
+    for (size_t c = 0; c < 3; c++)
+    {
+        target[c] = _mm256_load_si256((__m256i*) lanes[c]);
+        error[c] = _mm256_setzero_si256();
+    }
+
+    DTPixel plan[16][PATTERN_PLAN];
+    for (size_t i = 0; i < PATTERN_PLAN; i++)
+    {
+        __m256i rgb[3];
+        for (size_t c = 0; c < 3; c++)
+            rgb[c] = _mm256_min_epi16(_mm256_max_epi16(_mm256_add_epi16(target[c], error[c]),
+                                                       _mm256_setzero_si256()), _mm256_set1_epi16(255));
+        FindClosestColorsFromPalette(rgb, palette, palette_time);
+
+        for (size_t c = 0; c < 3; c++)
+        {
+            error[c] = _mm256_add_epi16(error[c], _mm256_sub_epi16(target[c], rgb[c]));
+            _mm256_store_si256((__m256i*) lanes[c], rgb[c]);
+        }
+        for (size_t l = 0; l < 16; l++)
+            plan[l][i] = (DTPixel) { (byte) lanes[0][l], (byte) lanes[1][l], (byte) lanes[2][l] };
+    }
+
+    for (size_t l = 0; l < MIN(16, count); l++)
+    {
+        // Insertion sort, stable so that equal-luma entries keep their order.
+        for (size_t i = 1; i < PATTERN_PLAN; i++)
+        {
+            DTPixel px = plan[l][i];
+            size_t j = i;
+            for (; j > 0 && pattern_luma(plan[l][j-1]) > pattern_luma(px); j--)
+                plan[l][j] = plan[l][j-1];
+            plan[l][j] = px;
+        }
+        memcpy(&plans[l*PATTERN_PLAN], plan[l], sizeof(plan[l]));
+    }
+}
+
+void
+ApplyOrderedDither(DTImage *image, DTPalettePacked *palette, size_t matrix_size, palette_time_t *palette_time)
+{
+    assert(matrix_size >= 2 && matrix_size <= BAYER_MAX && (matrix_size & (matrix_size - 1)) == 0);
+
+    uint16_t matrix[BAYER_MAX * BAYER_MAX];
+    bayer_matrix(matrix_size, matrix);
+
+    threshold_dither(image, palette, matrix, matrix_size, palette_time);
+}
+
+void
+ApplyBlueNoiseDither(DTImage *image, DTPalettePacked *palette, size_t mask_size, palette_time_t *palette_time)
+{
+    assert(mask_size == 64 || mask_size == 128);
+
+    // Generating a mask takes far longer than dithering with it, so it is
+    // done once and kept in the user's cache directory.
+    char path[4096];
+    int cached = blue_noise_cache_path(mask_size, path, sizeof(path));
+
+    uint16_t *mask = cached ? blue_noise_load(path, mask_size) : NULL;
+    if (mask == NULL)
+    {
+        mask = blue_noise_generate(mask_size);
+        if (cached)
+            blue_noise_store(path, mask, mask_size);
+    }
+
+    threshold_dither(image, palette, mask, mask_size, palette_time);
+
+    XFree(mask);
+}
+
+void
+ApplyPatternDither(DTImage *image, DTPalettePacked *palette, palette_time_t *palette_time)
+{
+    dt_time_t t;
+    DTTimeInit(&t);
+
+    size_t width = image->width;
+    size_t height = image->height;
+
+    uint16_t matrix[PATTERN_MATRIX * PATTERN_MATRIX];
+    bayer_matrix(PATTERN_MATRIX, matrix);
+
+    unsigned long long ws1, ws2;
+    TIMESTAMP(ws1);
+
+    // Mark the cells in use; racing threads all store the same value.
+    uint8_t *used = XCalloc(PATTERN_CELLS, sizeof(uint8_t));
+    #pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < width * height; i++)
+        __atomic_store_n(&used[pattern_cell(image->pixels[i])], 1, __ATOMIC_RELAXED);
+
+    // Give each of them a slot in the plan table.
+    uint32_t *slot = XMalloc(PATTERN_CELLS * sizeof(uint32_t));
+    uint32_t *cells = XMalloc(PATTERN_CELLS * sizeof(uint32_t));
+    size_t count = 0;
+    for (uint32_t cell = 0; cell < PATTERN_CELLS; cell++)
+        if (used[cell])
+        {
+            slot[cell] = (uint32_t) count;
+            cells[count++] = cell;
+        }
+    XFree(used);
+
+    DTPixel *plans = XMalloc(count * PATTERN_PLAN * sizeof(DTPixel));
+
+    // Plan entries land all over the color space and are searched once each,
+    // so they go straight to the vector search rather than the colormap.
+    DTPalettePacked direct = *palette;
+    direct.cmap = NULL;
+
+    #pragma omp parallel
+    {
+        dt_time_t local_time;
+        palette_time_t local_palette_time;
+        DTTimeInit(&local_time);
+        PaletteTimeInit(&local_palette_time);
+
+        unsigned long long ts1, ts2;
+        TIMESTAMP(ts1);
+
+        #pragma omp for schedule(dynamic)
+        for (size_t b = 0; b < count; b += 16)
+            pattern_plans16(&cells[b], count - b, &plans[b*PATTERN_PLAN], &direct, &local_palette_time);
+
+        // Each pixel is now a table lookup, its threshold picking the plan entry.
+        #pragma omp for schedule(static)
+        for (size_t i = 0; i < height; i++)
+        {
+            DTPixel *row = &image->pixels[i*width];
+            const uint16_t *thresholds = &matrix[(i % PATTERN_MATRIX)*PATTERN_MATRIX];
+            for (size_t j = 0; j < width; j++)
+            {
+                size_t entry = thresholds[j % PATTERN_MATRIX] * PATTERN_PLAN / (PATTERN_MATRIX * PATTERN_MATRIX);
+                row[j] = plans[slot[pattern_cell(row[j])]*PATTERN_PLAN + entry];
+            }
+        }
+
+        TIMESTAMP(ts2);
+        local_time.dither_time += (ts2 - ts1);
+
+        #pragma omp critical
+        {
+            t.dither_time += local_time.dither_time;
+            PaletteTimeAdd(palette_time, &local_palette_time);
+            t.threads++;
+        }
+    }
+
+    TIMESTAMP(ws2);
+    t.dither_units = width * height;
+    t.wave_time = (ws2 - ws1);
+    t.wave_units = width * height;
+
+    DTTimeReport(&t);
+
+    XFree(slot);
+    XFree(cells);
+    XFree(plans);
+}
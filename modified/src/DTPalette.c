@@ -14,66 +14,117 @@
 #include <immintrin.h>
 #include <XMalloc.h>
 
+/* width of a single palette search step, in entries */
+#define SEARCH_WIDTH 16
+
+/* the inverse colormap keeps the top CMAP_BITS of each channel */
+#define CMAP_BITS 6
+#define CMAP_SIZE (1u << (3*CMAP_BITS))
+
+DTPalettePacked *
+PaletteCreate(size_t size)
+{
+    DTPalettePacked *palette = XMalloc(sizeof(DTPalettePacked));
+    palette->size = size;
+    palette->stride = (size + SEARCH_WIDTH - 1) & ~((size_t) SEARCH_WIDTH - 1);
+    palette->colors = XMemalign(32, palette->stride*sizeof(int)*3);
+    palette->cmap = NULL;
+    palette->gray = NULL;
+    return palette;
+}
+
+void
+PalettePad(DTPalettePacked *palette)
+{
+    assert(palette->size > 0);
+
+    /* repeat the last color; ties keep the lower index, so it never wins */
+    for (size_t c = 0; c < 3; c++) {
+        int *plane = &palette->colors[palette->stride*c];
+        for (size_t i = palette->size; i < palette->stride; i++)
+            plane[i] = plane[palette->size-1];
+    }
+}
+
+void
+PaletteEnableColormap(DTPalettePacked *palette)
+{
+    if (palette->cmap == NULL)
+        palette->cmap = XCalloc(CMAP_SIZE, sizeof(uint16_t));
+}
+
+void
+PaletteDestroy(DTPalettePacked *palette)
+{
+    XFree(palette->cmap);
+    XFree(palette->gray);
+    XFree(palette->colors);
+    XFree(palette);
+}
+
 DTPalettePacked *
 StandardPaletteBW(size_t size)
 {
     if (size < 2) return NULL;
 
-    DTPalettePacked *palette = malloc(sizeof(DTPalettePacked));
-    palette->size = size;
-    palette->colors = XMalloc(size*sizeof(int)*3);
+    DTPalettePacked *palette = PaletteCreate(size);
 
     float step = 255.0f / (size - 1);
     for (size_t i = 0; i < size; i++) {
         palette->colors[i] = (byte) (float) roundf(i*step);
-        palette->colors[palette->size+i] = (byte) (float) roundf(i*step);
-        palette->colors[palette->size*2+i] = (byte) (float) roundf(i*step);
+        palette->colors[palette->stride+i] = (byte) (float) roundf(i*step);
+        palette->colors[palette->stride*2+i] = (byte) (float) roundf(i*step);
     }
+    PalettePad(palette);
     return palette;
 }
 
 DTPalettePacked *
 StandardPaletteRGB()
 {
-    DTPalettePacked *palette = malloc(sizeof(DTPalettePacked));
-    palette->size = 8;
-    palette->colors = XMalloc(palette->size*sizeof(int)*3);
-
-    palette->colors[0] = 0xFF;
-    palette->colors[1] = 0x00;
-    palette->colors[2] = 0x00;
-    palette->colors[3] = 0x00;
-    palette->colors[4] = 0xFF;
-    palette->colors[5] = 0xFF;
-    palette->colors[6] = 0x00;
-    palette->colors[7] = 0xFF;
-
-    palette->colors[8] = 0x00;
-    palette->colors[9] = 0xFF;
-    palette->colors[10] = 0x00;
-    palette->colors[11] = 0xFF;
-    palette->colors[12] = 0x00;
-    palette->colors[13] = 0xFF;
-    palette->colors[14] = 0x00;
-    palette->colors[15] = 0xFF;
-
-    palette->colors[16] = 0x00;
-    palette->colors[17] = 0x00;
-    palette->colors[18] = 0xFF;
-    palette->colors[19] = 0xFF;
-    palette->colors[20] = 0xFF;
-    palette->colors[21] = 0x00;
-    palette->colors[22] = 0x00;
-    palette->colors[23] = 0xFF;
+    static const DTPixel rgb[8] = {
+        { 0xFF, 0x00, 0x00 }, { 0x00, 0xFF, 0x00 },
+        { 0x00, 0x00, 0xFF }, { 0x00, 0xFF, 0xFF },
+        { 0xFF, 0x00, 0xFF }, { 0xFF, 0xFF, 0x00 },
+        { 0x00, 0x00, 0x00 }, { 0xFF, 0xFF, 0xFF }
+    };
 
+    DTPalettePacked *palette = PaletteCreate(8);
+    for (size_t i = 0; i < palette->size; i++) {
+        palette->colors[i] = rgb[i].r;
+        palette->colors[palette->stride+i] = rgb[i].g;
+        palette->colors[palette->stride*2+i] = rgb[i].b;
+    }
+    PalettePad(palette);
     return palette;
 }
 
-DTPixel
-FindClosestColorFromPalette(DTPixel needle, DTPalettePacked *palette, palette_time_t *time)
+/* returns the colormap cell holding the given color */
+static inline size_t
+ColormapCell(DTPixel px)
+{
+    const unsigned shift = 8 - CMAP_BITS;
+    return ((size_t)(px.r >> shift) << (2*CMAP_BITS)) |
+           ((size_t)(px.g >> shift) << CMAP_BITS) |
+           (size_t)(px.b >> shift);
+}
+
+/* returns the color at the center of the given color's cell */
+static inline DTPixel
+ColormapCenter(DTPixel px)
+{
+    const byte mask = (byte) (0xFF << (8 - CMAP_BITS));
+    const byte half = (byte) (1 << (7 - CMAP_BITS));
+    return (DTPixel) {
+        .r = (byte) ((px.r & mask) | half),
+        .g = (byte) ((px.g & mask) | half),
+        .b = (byte) ((px.b & mask) | half)
+    };
+}
+
+static size_t
+PaletteSearch(DTPixel needle, DTPalettePacked *palette)
 {
-    unsigned long long ts1, ts2;
-    TIMESTAMP(ts1);
     // indices on the current iteration
     __m256i curr_idx = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
     // the current minimum for each slice
@@ -86,16 +137,17 @@ FindClosestColorFromPalette(DTPixel needle, DTPalettePacked *palette, palette_ti
     const __m256i needle_r = _mm256_set1_epi32(needle.r);
     const __m256i needle_g = _mm256_set1_epi32(needle.g);
     const __m256i needle_b = _mm256_set1_epi32(needle.b);
+    const size_t stride = palette->stride;
 
     __m256i curr_r, curr_g, curr_b, dist, curr_r2, curr_g2, curr_b2, dist2, mask;
-    for (size_t i = 0; i < palette->size; i += 16) {
+    for (size_t i = 0; i < palette->size; i += SEARCH_WIDTH) {
         // load next 16 palette colors
         curr_r = _mm256_load_si256((__m256i*)&palette->colors[i]);
-        curr_g = _mm256_load_si256((__m256i*)&palette->colors[palette->size+i]);
-        curr_b = _mm256_load_si256((__m256i*)&palette->colors[palette->size*2+i]);
+        curr_g = _mm256_load_si256((__m256i*)&palette->colors[stride+i]);
+        curr_b = _mm256_load_si256((__m256i*)&palette->colors[stride*2+i]);
         curr_r2 = _mm256_load_si256((__m256i*)&palette->colors[i+8]);
-        curr_g2 = _mm256_load_si256((__m256i*)&palette->colors[palette->size+i+8]);
-        curr_b2 = _mm256_load_si256((__m256i*)&palette->colors[palette->size*2+i+8]);
+        curr_g2 = _mm256_load_si256((__m256i*)&palette->colors[stride+i+8]);
+        curr_b2 = _mm256_load_si256((__m256i*)&palette->colors[stride*2+i+8]);
         // subtract difference
         curr_r = _mm256_sub_epi32(needle_r, curr_r);
         curr_g = _mm256_sub_epi32(needle_g, curr_g);
@@ -145,26 +197,193 @@ FindClosestColorFromPalette(DTPixel needle, DTPalettePacked *palette, palette_ti
         }
     }
 
+    return (size_t) idx[k];
+}
+
+/*
+ * Cells hold index + 1, so zero marks a cell not yet searched. A cell is
+ * answered for its center color rather than for whichever pixel got there
+ * first, so racing threads always store the same index and relaxed loads and
+ * stores are enough; no lock is needed.
+ */
+static size_t
+ColormapLookup(DTPixel needle, DTPalettePacked *palette, palette_time_t *time)
+{
+    size_t cell = ColormapCell(needle);
+    uint16_t entry = __atomic_load_n(&palette->cmap[cell], __ATOMIC_RELAXED);
+    if (entry) {
+        time->cmap_hits++;
+        return (size_t) entry - 1;
+    }
+
+    size_t idx = PaletteSearch(ColormapCenter(needle), palette);
+    __atomic_store_n(&palette->cmap[cell], (uint16_t) (idx + 1), __ATOMIC_RELAXED);
+    time->cmap_misses++;
+    time->search_units += palette->size*3;
+    return idx;
+}
+
+/*
+ * Returns non-zero if every color is a grey level, after filling the table of
+ * the closest one to each grey. The table is filled by the regular search, so
+ * ties resolve as they would for a grey pixel in the three-channel path.
+ */
+int
+PaletteEnableGray(DTPalettePacked *palette)
+{
+    if (palette->gray)
+        return 1;
+
+    for (size_t i = 0; i < palette->size; i++) {
+        int r = palette->colors[i];
+        if (palette->colors[palette->stride+i] != r || palette->colors[palette->stride*2+i] != r)
+            return 0;
+    }
+
+    palette->gray = XMemalign(32, 256*sizeof(int));
+    for (int v = 0; v < 256; v++)
+        palette->gray[v] = palette->colors[PaletteSearch(PixelFromRGB((byte) v, (byte) v, (byte) v), palette)];
+    return 1;
+}
+
+DTPixel
+FindClosestColorFromPalette(DTPixel needle, DTPalettePacked *palette, palette_time_t *time)
+{
+    unsigned long long ts1, ts2;
+    TIMESTAMP(ts1);
+
+    size_t idx;
+    if (palette->cmap) {
+        idx = ColormapLookup(needle, palette, time);
+    } else {
+        idx = PaletteSearch(needle, palette);
+        time->search_units += palette->size*3;
+    }
+
     // return the pixel to original DTPixel format (rbg)
     DTPixel ret = {
-        .r = (byte)palette->colors[idx[k]],
-        .g = (byte)palette->colors[palette->size+(size_t)idx[k]],
-        .b = (byte)palette->colors[palette->size*2+(size_t)idx[k]]
+        .r = (byte)palette->colors[idx],
+        .g = (byte)palette->colors[palette->stride+idx],
+        .b = (byte)palette->colors[palette->stride*2+idx]
     };
 
     TIMESTAMP(ts2);
     time->search_time += (ts2 - ts1);
-    time->search_units += palette->size*3;
 
     return ret;
 }
 
+void
+FindClosestColorsFromPalette(__m256i *rgb, DTPalettePacked *palette, palette_time_t *time)
+{
+    unsigned long long ts1, ts2;
+    TIMESTAMP(ts1);
+
+    const int *colors = palette->colors;
+    const size_t stride = palette->stride;
+
+    if (palette->cmap) {
+        // the colormap is answered per pixel, so go through it lane by lane
+        __attribute__((aligned(32))) int16_t lanes[3][16];
+        _mm256_store_si256((__m256i*) lanes[0], rgb[0]);
+        _mm256_store_si256((__m256i*) lanes[1], rgb[1]);
+        _mm256_store_si256((__m256i*) lanes[2], rgb[2]);
+        for (size_t k = 0; k < 16; k++) {
+            DTPixel needle = { (byte) lanes[0][k], (byte) lanes[1][k], (byte) lanes[2][k] };
+            size_t idx = ColormapLookup(needle, palette, time);
+            lanes[0][k] = (int16_t) colors[idx];
+            lanes[1][k] = (int16_t) colors[stride+idx];
+            lanes[2][k] = (int16_t) colors[stride*2+idx];
+        }
+        rgb[0] = _mm256_load_si256((__m256i*) lanes[0]);
+        rgb[1] = _mm256_load_si256((__m256i*) lanes[1]);
+        rgb[2] = _mm256_load_si256((__m256i*) lanes[2]);
+
+        TIMESTAMP(ts2);
+        time->search_time += (ts2 - ts1);
+        return;
+    }
+
+    // Squared distances reach 3*255^2, so they are accumulated in 32 bits:
+    // interleaving (dr, dg) and (db, 0) lets madd square and sum each pair.
+    // The lo half holds lanes 0-3 and 8-11, the hi half 4-7 and 12-15, which
+    // packs_epi32 puts back in order at the end.
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i min_lo = _mm256_set1_epi32(255*255*3+1);
+    __m256i min_hi = min_lo;
+    __m256i idx_lo = zero;
+    __m256i idx_hi = zero;
+
+    // Entries are visited slice-major (i mod 8, then i) so that ties resolve
+    // exactly as in the 8-slice scalar search.
+    for (size_t slice = 0; slice < 8; slice++) {
+        for (size_t i = slice; i < stride; i += 8) {
+            __m256i curr = _mm256_set1_epi32((int) i);
+            __m256i dr = _mm256_sub_epi16(rgb[0], _mm256_set1_epi16((int16_t) colors[i]));
+            __m256i dg = _mm256_sub_epi16(rgb[1], _mm256_set1_epi16((int16_t) colors[stride+i]));
+            __m256i db = _mm256_sub_epi16(rgb[2], _mm256_set1_epi16((int16_t) colors[stride*2+i]));
+
+            __m256i rg_lo = _mm256_unpacklo_epi16(dr, dg);
+            __m256i rg_hi = _mm256_unpackhi_epi16(dr, dg);
+            __m256i b_lo = _mm256_unpacklo_epi16(db, zero);
+            __m256i b_hi = _mm256_unpackhi_epi16(db, zero);
+            __m256i dist_lo = _mm256_add_epi32(_mm256_madd_epi16(rg_lo, rg_lo), _mm256_madd_epi16(b_lo, b_lo));
+            __m256i dist_hi = _mm256_add_epi32(_mm256_madd_epi16(rg_hi, rg_hi), _mm256_madd_epi16(b_hi, b_hi));
+
+            __m256i mask_lo = _mm256_cmpgt_epi32(min_lo, dist_lo);
+            __m256i mask_hi = _mm256_cmpgt_epi32(min_hi, dist_hi);
+            idx_lo = _mm256_blendv_epi8(idx_lo, curr, mask_lo);
+            idx_hi = _mm256_blendv_epi8(idx_hi, curr, mask_hi);
+            min_lo = _mm256_min_epi32(min_lo, dist_lo);
+            min_hi = _mm256_min_epi32(min_hi, dist_hi);
+        }
+    }
+
+    // gather the chosen colors and restore the lane order
+    for (size_t c = 0; c < 3; c++) {
+        __m256i lo = _mm256_i32gather_epi32(&colors[stride*c], idx_lo, 4);
+        __m256i hi = _mm256_i32gather_epi32(&colors[stride*c], idx_hi, 4);
+        rgb[c] = _mm256_packs_epi32(lo, hi);
+    }
+
+    TIMESTAMP(ts2);
+    time->search_time += (ts2 - ts1);
+    time->search_units += palette->size*3*16;
+}
+
+void
+FindClosestGraysFromPalette(__m256i *gray, DTPalettePacked *palette, palette_time_t *time)
+{
+    unsigned long long ts1, ts2;
+    TIMESTAMP(ts1);
+
+    // one table lookup per lane, the lo half holding lanes 0-3 and 8-11 as
+    // in FindClosestColorsFromPalette
+    __m256i lo = _mm256_unpacklo_epi16(*gray, _mm256_setzero_si256());
+    __m256i hi = _mm256_unpackhi_epi16(*gray, _mm256_setzero_si256());
+    lo = _mm256_i32gather_epi32(palette->gray, lo, 4);
+    hi = _mm256_i32gather_epi32(palette->gray, hi, 4);
+    *gray = _mm256_packs_epi32(lo, hi);
+
+    TIMESTAMP(ts2);
+    time->search_time += (ts2 - ts1);
+    time->search_units += 16*3;
+}
+
 void
 PaletteTimeInit(palette_time_t *time) {
     assert(time);
     *time = (palette_time_t) { .search_time = 0 };
 }
 
+void
+PaletteTimeAdd(palette_time_t *dst, palette_time_t *src) {
+    dst->search_time += src->search_time;
+    dst->search_units += src->search_units;
+    dst->cmap_hits += src->cmap_hits;
+    dst->cmap_misses += src->cmap_misses;
+}
+
 void
 PaletteTimeReport(palette_time_t *time) {
     const double ops_per_pix = 3.0;
@@ -179,4 +398,10 @@ PaletteTimeReport(palette_time_t *time) {
     double search_peak = (search_perf / search_theoretical) * 100;
 
     printf("Palette Search%11s%-20.6lf%-20.6lf%.2lf%%\n", "", search_time, search_pix, search_peak);
+
+    unsigned long long lookups = time->cmap_hits + time->cmap_misses;
+    if (lookups) {
+        double hit_rate = ((double) time->cmap_hits / (double) lookups) * 100;
+        printf(" Colormap Hits%11s%-20llu%-20llu%.2lf%%\n", "", time->cmap_hits, time->cmap_misses, hit_rate);
+    }
 }
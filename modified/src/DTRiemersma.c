@@ -0,0 +1,274 @@
+/*
+ *  DTRiemersma.c
+ *  dither Utility
+ *
+ *  Riemersma dithering: error diffusion along a Hilbert curve.
+ *
+ */
+
+#include <DTDither.h>
+#include <UtilMacro.h>
+#include <XMalloc.h>
+
+#include <stdint.h>
+#include <immintrin.h>
+#include <math.h>
+
+#include <string.h>
+#include <assert.h>
+
+/*
+ * The image is cut into RM_TILE x RM_TILE tiles, each walked along the same
+ * Hilbert curve with its own error queue. Sixteen tiles are walked in
+ * lockstep, one per lane, so every step of the curve is one vector per
+ * channel and one batched palette search. Tiles are first gathered into
+ * curve order (step-major, then channel, then lane), which turns the walk
+ * itself into a purely sequential stream.
+ */
+#define RM_TILE 32
+#define RM_STEPS (RM_TILE * RM_TILE)
+
+// Queue length, and weight of the youngest error relative to the oldest.
+#define RM_QUEUE 16
+#define RM_MAX 16
+
+// Planes per step in the gathered tiles: r, g, b and the in-image mask.
+#define RM_PLANES 4
+
+/// @brief Position (x, y) of step d along the Hilbert curve filling an n x n square.
+static void hilbert_d2xy(size_t n, size_t d, size_t *x, size_t *y)
+{
+    size_t rx, ry, t = d;
+    *x = *y = 0;
+    for (size_t s = 1; s < n; s *= 2)
+    {
+        rx = 1 & (t / 2);
+        ry = 1 & (t ^ rx);
+        if (ry == 0)
+        {
+            if (rx == 1)
+            {
+                *x = s - 1 - *x;
+                *y = s - 1 - *y;
+            }
+            SWAP(*x, *y);
+        }
+        *x += s * rx;
+        *y += s * ry;
+        t /= 4;
+    }
+}
+
+/**
+ * Loads the 16 tiles starting at tile first into curve order, path giving the
+ * tile pixel, as y*RM_TILE + x, visited at each step. Lanes past the last
+ * tile, or steps falling outside the image, read a zero pixel with a clear
+ * mask.
+ */
+static void rm_gather(DTImage *image, const uint16_t *path, size_t tiles_x, size_t tiles,
+                      size_t first, int16_t *walk)
+{
+    for (size_t l = 0; l < 16; l++)
+    {
+        size_t tile = first + l;
+        size_t x0 = (tile % tiles_x) * RM_TILE;
+        size_t y0 = (tile / tiles_x) * RM_TILE;
+        const DTPixel *origin = &image->pixels[y0*image->width + x0];
+
+        if (tile < tiles && x0 + RM_TILE <= image->width && y0 + RM_TILE <= image->height)
+        {
+            for (size_t s = 0; s < RM_STEPS; s++)
+            {
+                const DTPixel *p = &origin[(path[s] / RM_TILE)*image->width + path[s] % RM_TILE];
+                int16_t *step = &walk[s*RM_PLANES*16 + l];
+                step[0*16] = p->r;
+                step[1*16] = p->g;
+                step[2*16] = p->b;
+                step[3*16] = -1;
+            }
+            continue;
+        }
+
+        for (size_t s = 0; s < RM_STEPS; s++)
+        {
+            size_t x = x0 + path[s] % RM_TILE;
+            size_t y = y0 + path[s] / RM_TILE;
+            int16_t *step = &walk[s*RM_PLANES*16 + l];
+
+            if (tile < tiles && x < image->width && y < image->height)
+            {
+                DTPixel p = image->pixels[y*image->width + x];
+                step[0*16] = p.r;
+                step[1*16] = p.g;
+                step[2*16] = p.b;
+                step[3*16] = -1;
+            }
+            else
+            {
+                for (size_t c = 0; c < RM_PLANES; c++)
+                    step[c*16] = 0;
+            }
+        }
+    }
+}
+
+/**
+ * Inverse of rm_gather, writing back only the pixels inside the image. Tiles
+ * are written row by row, rank giving the step at which each pixel was
+ * visited.
+ */
+static void rm_scatter(DTImage *image, const uint16_t *rank, size_t tiles_x, size_t tiles,
+                       size_t first, const int16_t *walk)
+{
+    for (size_t l = 0; l < 16 && first + l < tiles; l++)
+    {
+        size_t x0 = ((first + l) % tiles_x) * RM_TILE;
+        size_t y0 = ((first + l) / tiles_x) * RM_TILE;
+        size_t w = MIN(RM_TILE, image->width - x0);
+        size_t h = MIN(RM_TILE, image->height - y0);
+
+        for (size_t y = 0; y < h; y++)
+        {
+            DTPixel *row = &image->pixels[(y0 + y)*image->width + x0];
+            for (size_t x = 0; x < w; x++)
+            {
+                const int16_t *step = &walk[rank[y*RM_TILE + x]*RM_PLANES*16 + l];
+                row[x].r = (byte) step[0*16];
+                row[x].g = (byte) step[1*16];
+                row[x].b = (byte) step[2*16];
+            }
+        }
+    }
+}
+
+/**
+ * Walks 16 gathered tiles along the curve. Each pixel gets the weighted sum
+ * of the last RM_QUEUE errors (oldest weighted 1, youngest RM_MAX) divided by
+ * RM_MAX, and its own error is taken against the original pixel, as in
+ * Riemersma's formulation. The queue is a ring of one vector per channel per
+ * entry; head is the oldest entry, which the new error replaces.
+ */
+static void rm_walk(int16_t *walk, const int16_t *weights, DTPalettePacked *palette,
+                    palette_time_t *palette_time)
+{
+    __m256i queue[RM_QUEUE][3];
+    memset(queue, 0, sizeof(queue));
+    size_t head = 0;
+
+    for (size_t s = 0; s < RM_STEPS; s++)
+    {
+        int16_t *step = &walk[s*RM_PLANES*16];
+        __m256i original[3], rgb[3];
+
+        for (size_t c = 0; c < 3; c++)
+        {
+            __m256i acc = _mm256_setzero_si256();
+            for (size_t i = 0; i < RM_QUEUE; i++)
+                acc = _mm256_add_epi16(acc, _mm256_mullo_epi16(queue[(head + i) % RM_QUEUE][c],
+                                                               _mm256_set1_epi16(weights[i])));
+
+            original[c] = _mm256_load_si256((__m256i*) &step[c*16]);
+            __m256i v = _mm256_add_epi16(original[c], _mm256_srai_epi16(acc, 4));
+            rgb[c] = _mm256_min_epi16(_mm256_max_epi16(v, _mm256_setzero_si256()), _mm256_set1_epi16(255));
+        }
+
+        FindClosestColorsFromPalette(rgb, palette, palette_time);
+
+        // Steps outside the image push a zero error.
+        __m256i mask = _mm256_load_si256((__m256i*) &step[3*16]);
+        for (size_t c = 0; c < 3; c++)
+        {
+            queue[head][c] = _mm256_and_si256(_mm256_sub_epi16(original[c], rgb[c]), mask);
+            _mm256_store_si256((__m256i*) &step[c*16], rgb[c]);
+        }
+        head = (head + 1) % RM_QUEUE;
+    }
+}
+
+void
+ApplyRiemersmaDither(DTImage *image, DTPalettePacked *palette, palette_time_t *palette_time)
+{
+    assert(RM_MAX == 16);
+
+    dt_time_t t;
+    DTTimeInit(&t);
+
+    // Tile pixel visited at each step of the curve, as y*RM_TILE + x, and its inverse.
+    uint16_t path[RM_STEPS], rank[RM_STEPS];
+    for (size_t s = 0; s < RM_STEPS; s++)
+    {
+        size_t x, y;
+        hilbert_d2xy(RM_TILE, s, &x, &y);
+        path[s] = (uint16_t) (y*RM_TILE + x);
+        rank[path[s]] = (uint16_t) s;
+    }
+
+    // Weights grow geometrically from 1 to RM_MAX, oldest first.
+    int16_t weights[RM_QUEUE];
+    double ratio = exp(log((double) RM_MAX) / (RM_QUEUE - 1));
+    double v = 1.0;
+    for (size_t i = 0; i < RM_QUEUE; i++, v *= ratio)
+        weights[i] = (int16_t) (v + 0.5);
+
+    size_t tiles_x = (image->width + RM_TILE - 1) / RM_TILE;
+    size_t tiles_y = (image->height + RM_TILE - 1) / RM_TILE;
+    size_t tiles = tiles_x * tiles_y;
+    size_t groups = (tiles + 15) / 16;
+
+    unsigned long long ws1, ws2;
+    TIMESTAMP(ws1);
+
+    #pragma omp parallel
+    {
+        dt_time_t local_time;
+        palette_time_t local_palette_time;
+        DTTimeInit(&local_time);
+        PaletteTimeInit(&local_palette_time);
+
+        int16_t *walk = XMemalign(32, RM_STEPS * RM_PLANES * 16 * sizeof(int16_t));
+
+        #pragma omp for schedule(dynamic)
+        for (size_t g = 0; g < groups; g++)
+        {
+            unsigned long long ts1, ts2;
+
+            TIMESTAMP(ts1);
+            rm_gather(image, path, tiles_x, tiles, g*16, walk);
+            TIMESTAMP(ts2);
+            local_time.shift_time += (ts2 - ts1);
+            local_time.shift_units += 16 * RM_STEPS;
+
+            TIMESTAMP(ts1);
+            rm_walk(walk, weights, palette, &local_palette_time);
+            TIMESTAMP(ts2);
+            local_time.dither_time += (ts2 - ts1);
+            local_time.dither_units += 16 * RM_STEPS;
+
+            TIMESTAMP(ts1);
+            rm_scatter(image, rank, tiles_x, tiles, g*16, walk);
+            TIMESTAMP(ts2);
+            local_time.deshift_time += (ts2 - ts1);
+            local_time.deshift_units += 16 * RM_STEPS;
+        }
+
+        XFree(walk);
+
+        #pragma omp critical
+        {
+            t.shift_time += local_time.shift_time;
+            t.shift_units += local_time.shift_units;
+            t.dither_time += local_time.dither_time;
+            t.dither_units += local_time.dither_units;
+            t.deshift_time += local_time.deshift_time;
+            t.deshift_units += local_time.deshift_units;
+            PaletteTimeAdd(palette_time, &local_palette_time);
+            t.threads++;
+        }
+    }
+
+    TIMESTAMP(ws2);
+    t.wave_time = (ws2 - ws1);
+    t.wave_units = image->width * image->height;
+
+    DTTimeReport(&t);
+}
@@ -10,10 +10,13 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 #include <math.h>
+#include <stdbool.h>
 
 #include <MedianPartition.h>
+#include <DTPixelPack.h>
 #include <XMalloc.h>
 #include <UtilMacro.h>
 
@@ -44,23 +47,72 @@ typedef struct {
     uint8_t *b;
 } MCCube;
 
+/**
+ * Cubes of at least this many pixels are split by every thread at once, with
+ * ParallelMedianPartition; smaller ones go to tasks.
+ */
+#define MC_SPLIT_CUTOFF ((size_t) 1 << 18)
+
+/**
+ * Every split is recorded in a tree laid out as a binary heap: node 1 is the
+ * first split, and nodes 2n and 2n + 1 split the two halves of node n, so
+ * descending past the last level lands on n - size, the index of a cube. Each
+ * node holds the threshold of its split, at or below which colors went low,
+ * and the bit offset of the split channel in a packed r | g << 8 | b << 16
+ * color.
+ */
+#define MC_TREE_NODE(channel, threshold) \
+    ((uint32_t) (threshold) | ((uint32_t) (8 * (channel)) << 8))
+
 struct mc_workspace_t {
     mc_byte_t level;
+    mc_engine_t engine;
+    mc_color_t color;
     MCCube *cubes;
+    uint32_t *tree;
     DTPalette *palette;
     mp_workspace_t mp;
+
+    // Cubes split out of place move between the planes of the image and the
+    // same range of these scratch planes: those split by every thread at
+    // once, and all of them with the scatter engine.
+    bool parallel;
+    mp_parallel_t mpp;
+    size_t plane_size;
+    uint8_t *planes[2][NUM_DIM];
 };
 
 MCWorkspace *
-MCWorkspaceMake(mc_byte_t level, size_t img_size)
+MCWorkspaceMake(mc_byte_t level, size_t img_size, mc_engine_t engine,
+                mc_color_t color)
 {
     MCWorkspace *ws = XMalloc(sizeof(MCWorkspace));
     ws->level = level;
+    ws->engine = engine;
+    ws->color = color;
     ws->palette = XMalloc(sizeof(DTPalette));
     ws->palette->size = 1 << level;
     ws->palette->colors = XMalloc(sizeof(DTPixel) * ws->palette->size);
     ws->cubes = XMalloc(sizeof(MCCube) * ws->palette->size);
+    ws->tree = XMalloc(sizeof(uint32_t) * ws->palette->size);
     MPWorkspaceInit(&ws->mp, img_size);
+
+    // Only the partition engines move the pixels themselves.
+    bool pixels = (engine == MC_ENGINE_PARTITION) || (engine == MC_ENGINE_SCATTER);
+    ws->parallel = pixels && (img_size >= MC_SPLIT_CUTOFF);
+    ws->plane_size = img_size;
+    for (size_t c = 0; c < NUM_DIM; c++) {
+        ws->planes[0][c] = NULL;
+        ws->planes[1][c] = NULL;
+    }
+    if (ws->parallel) {
+        MPParallelInit(&ws->mpp, img_size);
+    }
+    if (ws->parallel || engine == MC_ENGINE_SCATTER) {
+        for (size_t c = 0; c < NUM_DIM; c++) {
+            ws->planes[1][c] = XMemalign(32, img_size);
+        }
+    }
     return ws;
 }
 
@@ -68,8 +120,17 @@ void
 MCWorkspaceDestroy(MCWorkspace *ws)
 {
     free(ws->cubes);
+    free(ws->tree);
     free(ws->palette);
     MPWorkspaceDestroy(&ws->mp);
+    if (ws->parallel) {
+        MPParallelDestroy(&ws->mpp);
+    }
+    if (ws->planes[1][0]) {
+        for (size_t c = 0; c < NUM_DIM; c++) {
+            XFree(ws->planes[1][c]);
+        }
+    }
     free(ws);
 }
 
@@ -285,13 +346,120 @@ MCCalculateBiggestDimension(
     return (color_dim_t) ((r_gt_g << 2) | (r_gt_b << 1) | g_gt_b);
 }
 
+/**
+ * @brief Channel order handed to the partition for each dimension.
+ */
+static const size_t mc_channel_order[8][NUM_DIM] = {
+    [DIM_RGB] = { 0, 1, 2 },
+    [DIM_RBG] = { 0, 2, 1 },
+    [DIM_GRB] = { 1, 0, 2 },
+    [DIM_GBR] = { 1, 2, 0 },
+    [DIM_BRG] = { 2, 0, 1 },
+    [DIM_BGR] = { 2, 1, 0 }
+};
+
+/**
+ * @brief Points src at the channels of the cube, in the given order, and dst
+ *        at the same range of the other set of planes.
+ * @return The planes the cube moves to.
+ */
+static uint8_t *const *
+MCScatterPlanes(
+    const MCWorkspace *ws,
+    const MCCube *cube,
+    const size_t order[NUM_DIM],
+    uint8_t *src[NUM_DIM],
+    uint8_t *dst[NUM_DIM],
+    size_t *offset
+) {
+    uint8_t *channels[NUM_DIM] = { cube->r, cube->g, cube->b };
+    uintptr_t base = (uintptr_t) ws->planes[0][0];
+    size_t from = ((uintptr_t) channels[0] - base < ws->plane_size) ? 0 : 1;
+    *offset = (size_t) (channels[0] - ws->planes[from][0]);
+
+    for (size_t c = 0; c < NUM_DIM; c++) {
+        src[c] = channels[order[c]];
+        dst[c] = &ws->planes[!from][order[c]][*offset];
+    }
+
+    return ws->planes[!from];
+}
+
+/**
+ * @brief Node of the split tree for the split of lo into [lo, hi]: both start
+ *        a half of a range of cubes twice as long as the distance between them.
+ */
+static uint32_t *
+MCTreeNode(
+    const MCWorkspace *ws,
+    const MCCube *lo,
+    const MCCube *hi
+) {
+    size_t base = (size_t) (lo - ws->cubes);
+    size_t span = 2 * (size_t) (hi - lo);
+    return &ws->tree[(((size_t) 1 << ws->level) + base) / span];
+}
+
+/**
+ * @brief Fills in both halves of a split cube, from offset on in the given
+ *        planes, with the bounds found by the partition, and records the
+ *        split in the given node of the split tree.
+ * @param lo_size The size of the lo half.
+ * @param size The size of the whole cube.
+ */
+static void
+MCSplitCubes(
+    uint8_t *const *to,
+    size_t offset,
+    const size_t order[NUM_DIM],
+    const mp_bounds_t *bounds,
+    size_t lo_size,
+    size_t size,
+    MCCube *lo,
+    MCCube *hi,
+    uint32_t *node
+) {
+    // Only elements on the median may go either way; they are all in lo.
+    *node = MC_TREE_NODE(order[0], bounds->lo_max[0]);
+
+    uint8_t lo_min[NUM_DIM], lo_max[NUM_DIM], hi_min[NUM_DIM], hi_max[NUM_DIM];
+    for (size_t c = 0; c < NUM_DIM; c++) {
+        lo_min[order[c]] = bounds->lo_min[c];
+        lo_max[order[c]] = bounds->lo_max[c];
+        hi_min[order[c]] = bounds->hi_min[c];
+        hi_max[order[c]] = bounds->hi_max[c];
+    }
+
+    *lo = (MCCube) {
+        .min = { .r = lo_min[0], .g = lo_min[1], .b = lo_min[2] },
+        .max = { .r = lo_max[0], .g = lo_max[1], .b = lo_max[2] },
+        .size = lo_size,
+        .r = &to[0][offset],
+        .g = &to[1][offset],
+        .b = &to[2][offset]
+    };
+    *hi = (MCCube) {
+        .min = { .r = hi_min[0], .g = hi_min[1], .b = hi_min[2] },
+        .max = { .r = hi_max[0], .g = hi_max[1], .b = hi_max[2] },
+        .size = size - lo_size,
+        .r = &to[0][offset + lo_size],
+        .g = &to[1][offset + lo_size],
+        .b = &to[2][offset + lo_size]
+    };
+}
+
 /**
  * @brief Splits lo across its median into [lo, hi].
+ *
+ * Both halves come out with their bounds already found by the partition. With
+ * the scatter engine, they move to the other set of planes.
+ *
  * @param lo The cube to be split and the output lo half.
  * @param hi The output hi half.
  */
 static void
 MCSplit(
+    const MCWorkspace *mc,
     MCCube *lo,
     MCCube *hi,
     mp_workspace_t *ws,
@@ -300,57 +468,34 @@ MCSplit(
     assert(lo);
     assert(hi);
 
-    // Determine which color has the biggest range.
-    color_dim_t dim = MCCalculateBiggestDimension(lo);
-
-    // Partition across the median in the selected dimension.
+    // Partition across the median in the dimension with the biggest range.
+    const size_t *order = mc_channel_order[MCCalculateBiggestDimension(lo)];
+    uint8_t *src[NUM_DIM], *dst[NUM_DIM];
+    size_t offset = 0;
     size_t mid = 0;
-    unsigned long long ts1, ts2;
-    switch (dim) {
-        case DIM_RGB:
-            TIMESTAMP(ts1);
-            mid = MedianPartition(ws, lo->r, lo->g, lo->b, lo->size, time);
-            TIMESTAMP(ts2);
-            break;
-        case DIM_RBG:
-            TIMESTAMP(ts1);
-            mid = MedianPartition(ws, lo->r, lo->b, lo->g, lo->size, time);
-            TIMESTAMP(ts2);
-            break;
-        case DIM_GRB:
-            TIMESTAMP(ts1);
-            mid = MedianPartition(ws, lo->g, lo->r, lo->b, lo->size, time);
-            TIMESTAMP(ts2);
-            break;
-        case DIM_GBR:
-            TIMESTAMP(ts1);
-            mid = MedianPartition(ws, lo->g, lo->b, lo->r, lo->size, time);
-            TIMESTAMP(ts2);
-            break;
-        case DIM_BRG:
-            TIMESTAMP(ts1);
-            mid = MedianPartition(ws, lo->b, lo->r, lo->g, lo->size, time);
-            TIMESTAMP(ts2);
-            break;
-        case DIM_BGR:
-            TIMESTAMP(ts1);
-            mid = MedianPartition(ws, lo->b, lo->g, lo->r, lo->size, time);
-            TIMESTAMP(ts2);
-            break;
-        default:
-            assert(0);
-    }
-
-    time->mid_time += (ts2 - ts1);
-    time->mid_units += lo->size;
-
-    // Split the cubes by size.
-    *hi = *lo;
-    lo->size = mid + 1;
-    hi->r += lo->size;
-    hi->g += lo->size;
-    hi->b += lo->size;
-    hi->size -= lo->size;
+    mp_bounds_t bounds;
+
+    if (mc->engine == MC_ENGINE_SCATTER) {
+        uint8_t *const *to = MCScatterPlanes(mc, lo, order, src, dst, &offset);
+        MC_TIME(
+            time->mid,
+            lo->size,
+            mid = ScatterMedianPartition(src, dst, lo->size, &bounds, time);
+        );
+        MCSplitCubes(to, offset, order, &bounds, mid + 1, lo->size, lo, hi,
+                     MCTreeNode(mc, lo, hi));
+        return;
+    }
+
+    uint8_t *channels[NUM_DIM] = { lo->r, lo->g, lo->b };
+    MC_TIME(
+        time->mid,
+        lo->size,
+        mid = MedianPartition(ws, channels[order[0]], channels[order[1]],
+                              channels[order[2]], lo->size, &bounds, time);
+    );
+    MCSplitCubes(channels, 0, order, &bounds, mid + 1, lo->size, lo, hi,
+                 MCTreeNode(mc, lo, hi));
 }
 
 static DTPixel
@@ -364,6 +509,112 @@ MCCubeAverage(
     };
 }
 
+/**
+ * @brief Rounded mean of a channel, summed 32 bytes at a time with SAD
+ *        against zero.
+ */
+static uint8_t
+MCChannelMean(
+    const uint8_t *channel,
+    size_t size
+) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i sums = zero;
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) &channel[i]);
+        sums = _mm256_add_epi64(sums, _mm256_sad_epu8(v, zero));
+    }
+
+    uint64_t sum = (uint64_t) _mm256_extract_epi64(sums, 0) +
+                   (uint64_t) _mm256_extract_epi64(sums, 1) +
+                   (uint64_t) _mm256_extract_epi64(sums, 2) +
+                   (uint64_t) _mm256_extract_epi64(sums, 3);
+    for (; i < size; i++) {
+        sum += channel[i];
+    }
+
+    return (uint8_t) ((sum + size / 2) / size);
+}
+
+/**
+ * @brief Median of a channel, the value holding rank size / 2, counted from
+ *        the lower bound of the channel up. Runs of equal bytes are common, so
+ *        the counts are spread over four tables to keep increments of the
+ *        same value from waiting on each other.
+ */
+static uint8_t
+MCChannelMedian(
+    const uint8_t *channel,
+    size_t size,
+    uint8_t min
+) {
+    uint32_t counts[4][256] = { { 0 } };
+    size_t i = 0;
+    for (; i + 4 <= size; i += 4) {
+        counts[0][channel[i]]++;
+        counts[1][channel[i + 1]]++;
+        counts[2][channel[i + 2]]++;
+        counts[3][channel[i + 3]]++;
+    }
+    for (; i < size; i++) {
+        counts[0][channel[i]]++;
+    }
+
+    size_t half = size >> 1, seen = 0;
+    size_t v = min;
+    while ((seen += (size_t) counts[0][v] + counts[1][v] + counts[2][v] + counts[3][v]) <= half &&
+           v < 255) {
+        v++;
+    }
+    return (uint8_t) v;
+}
+
+/**
+ * @brief Color a final cube stands for in the palette. Empty cubes fall back
+ *        to the midpoint of their bounds.
+ */
+static DTPixel
+MCCubeColor(
+    const MCWorkspace *ws,
+    MCCube *cube
+) {
+    if (cube->size == 0 || ws->color == MC_COLOR_MIDPOINT) {
+        return MCCubeAverage(cube);
+    }
+
+    if (ws->color == MC_COLOR_MEAN) {
+        return (DTPixel) {
+            .r = MCChannelMean(cube->r, cube->size),
+            .g = MCChannelMean(cube->g, cube->size),
+            .b = MCChannelMean(cube->b, cube->size)
+        };
+    }
+
+    return (DTPixel) {
+        .r = MCChannelMedian(cube->r, cube->size, cube->min.r),
+        .g = MCChannelMedian(cube->g, cube->size, cube->min.g),
+        .b = MCChannelMedian(cube->b, cube->size, cube->min.b)
+    };
+}
+
+/**
+ * @brief Sets the palette color of a final cube, right after its last split
+ *        while its pixels are still in cache.
+ */
+static void
+MCFinishCube(
+    const MCWorkspace *ws,
+    MCCube *cube,
+    mc_time_t *time
+) {
+    MC_TIME(
+        time->color,
+        cube->size,
+        ws->palette->colors[cube - ws->cubes] = MCCubeColor(ws, cube);
+    );
+}
+
 static void
 MCTimeAdd(
     mc_time_t *dst,
@@ -383,65 +634,226 @@ MCTimeAdd(
     dst->sub_units += src->sub_units;
     dst->full_time += src->full_time;
     dst->full_units += src->full_units;
+    dst->hist_time += src->hist_time;
+    dst->hist_units += src->hist_units;
+    dst->sort_time += src->sort_time;
+    dst->sort_units += src->sort_units;
+    dst->cut_time += src->cut_time;
+    dst->cut_units += src->cut_units;
+    dst->count_time += src->count_time;
+    dst->count_units += src->count_units;
+    dst->gather_time += src->gather_time;
+    dst->gather_units += src->gather_units;
+    dst->color_time += src->color_time;
+    dst->color_units += src->color_units;
+    dst->map_time += src->map_time;
+    dst->map_units += src->map_units;
+    dst->moved_bytes += src->moved_bytes;
+    dst->splits += src->splits;
 }
 
 static void
 MCQuantizeNext(
+    const MCWorkspace *mc,
     MCCube *cubes,
     size_t size,
     mc_byte_t level,
     mp_workspace_t *ws,
     mc_time_t *time
 ) {
-    if (level == 0) { return; }
+    if (level == 0) {
+        MCFinishCube(mc, cubes, time);
+        return;
+    }
 
     size_t offset = size >> 1;
-    MCSplit(&cubes[0], &cubes[offset], ws, time);
-    MCShrinkCube(&cubes[0], time);
-    MCShrinkCube(&cubes[offset], time);
-    MCQuantizeNext(&cubes[0], offset, level - 1, ws, time);
-    MCQuantizeNext(&cubes[offset], size - offset, level - 1, ws, time);
+    MCSplit(mc, &cubes[0], &cubes[offset], ws, time);
+    MCQuantizeNext(mc, &cubes[0], offset, level - 1, ws, time);
+    MCQuantizeNext(mc, &cubes[offset], size - offset, level - 1, ws, time);
 }
 
+/**
+ * @brief Task-parallel version of MCQuantizeNext.
+ *
+ * Each split hands its hi half to a new task and keeps recursing into the lo
+ * half itself, so idle threads pick up whichever subtrees remain rather than
+ * waiting on a fixed pairing of halves. Subtrees of fewer than MC_TASK_CUTOFF
+ * pixels are finished serially by the task that reaches them.
+ *
+ * Every subtree only partitions its own range of pixels, so it gets the
+ * matching slice of the partition counts: a cube of n pixels never needs more
+ * than n / 32 of them.
+ */
+#define MC_TASK_CUTOFF ((size_t) 1 << 16)
+
 static void
 ParallelMCQuantizeNext(
+    const MCWorkspace *mc,
     MCCube *cubes,
     size_t size,
     mc_byte_t level,
     mp_workspace_t *ws,
     mc_time_t *time
 ) {
-    if (level == 0) { return; }
+    if (level == 0) {
+        MCFinishCube(mc, cubes, time);
+        return;
+    }
+
+    if (cubes[0].size < MC_TASK_CUTOFF) {
+        MCQuantizeNext(mc, cubes, size, level, ws, time);
+        return;
+    }
 
-    mc_time_t t1, t2;
-    MCTimeInit(&t1);
-    MCTimeInit(&t2);
     size_t offset = size >> 1;
-    MCSplit(&cubes[0], &cubes[offset], ws, time);
-    #pragma omp parallel sections
+    MCSplit(mc, &cubes[0], &cubes[offset], ws, time);
+
+    // The lo half is split again below while the task may still be waiting to
+    // start, so its slice of the counts must be taken now.
+    mp_workspace_t hi_ws = {
+        .counts = &ws->counts[cubes[0].size / 32]
+    };
+    mc_time_t hi_time;
+    MCTimeInit(&hi_time);
+
+    #pragma omp task shared(hi_time)
+    ParallelMCQuantizeNext(mc, &cubes[offset], size - offset, level - 1, &hi_ws, &hi_time);
+
+    ParallelMCQuantizeNext(mc, &cubes[0], offset, level - 1, ws, time);
+
+    #pragma omp taskwait
+    MCTimeAdd(time, &hi_time);
+}
+
+/**
+ * @brief Finds the bounds of the cube with every thread of the team.
+ */
+static void
+MCParallelShrinkCube(
+    MCCube *cube,
+    mc_time_t *time
+) {
+    const size_t blocks = (cube->size + MP_BLOCK_SIZE - 1) / MP_BLOCK_SIZE;
+    DTPixel min = { .r = 255, .g = 255, .b = 255 };
+    DTPixel max = { .r = 0, .g = 0, .b = 0 };
+    mc_time_t local;
+    MCTimeInit(&local);
+
+    #pragma omp for schedule(static)
+    for (size_t i = 0; i < blocks; i++) {
+        size_t begin = i * MP_BLOCK_SIZE;
+        MCCube part = {
+            .r = &cube->r[begin],
+            .g = &cube->g[begin],
+            .b = &cube->b[begin],
+            .size = MIN(cube->size - begin, MP_BLOCK_SIZE)
+        };
+
+        MCShrinkCube(&part, &local);
+        min.r = MIN(min.r, part.min.r);
+        min.g = MIN(min.g, part.min.g);
+        min.b = MIN(min.b, part.min.b);
+        max.r = MAX(max.r, part.max.r);
+        max.g = MAX(max.g, part.max.g);
+        max.b = MAX(max.b, part.max.b);
+    }
+
+    // Every thread has read the cube by the end of the loop.
+    #pragma omp single
     {
-        #pragma omp section
-        {
-            mp_workspace_t local_ws = {
-                .counts = &ws->counts[0]
-            };
+        cube->min = min;
+        cube->max = max;
+    }
 
-            MCShrinkCube(&cubes[0], &t1);
-            ParallelMCQuantizeNext(&cubes[0], offset, level - 1, &local_ws, &t1);
-        }
-        #pragma omp section
-        {
-            mp_workspace_t local_ws = {
-                .counts = &ws->counts[(cubes[offset].size / 32)]
-            };
+    #pragma omp critical
+    {
+        cube->min.r = MIN(cube->min.r, min.r);
+        cube->min.g = MIN(cube->min.g, min.g);
+        cube->min.b = MIN(cube->min.b, min.b);
+        cube->max.r = MAX(cube->max.r, max.r);
+        cube->max.g = MAX(cube->max.g, max.g);
+        cube->max.b = MAX(cube->max.b, max.b);
+        MCTimeAdd(time, &local);
+    }
+
+    #pragma omp barrier
+}
+
+/**
+ * @brief Splits lo across its median into [lo, hi] with every thread of the
+ *        team, leaving both halves in the other set of planes with their
+ *        bounds already found.
+ * @param size The size of lo.
+ * @return The size of the new lo half.
+ */
+static size_t
+MCParallelSplit(
+    MCWorkspace *ws,
+    MCCube *lo,
+    MCCube *hi,
+    size_t size,
+    mc_time_t *time
+) {
+    const size_t *order = mc_channel_order[MCCalculateBiggestDimension(lo)];
+
+    uint8_t *src[NUM_DIM], *dst[NUM_DIM];
+    size_t offset;
+    uint8_t *const *to = MCScatterPlanes(ws, lo, order, src, dst, &offset);
+
+    size_t mid = ParallelMedianPartition(&ws->mpp, src, dst, size, time);
+
+    #pragma omp single
+    MCSplitCubes(to, offset, order, &ws->mpp.bounds, mid + 1, size, lo, hi,
+                 MCTreeNode(ws, lo, hi));
+
+    return mid + 1;
+}
+
+/**
+ * @brief Runs the top of the median-cut tree with every thread of the team.
+ *
+ * Cubes of MC_SPLIT_CUTOFF pixels or more are split by all the threads
+ * together; the subtree below each smaller cube becomes a task, which the
+ * threads pick up while waiting on the next collective split or at the end of
+ * the parallel region. Sizes are passed down rather than read back from the
+ * cubes, which those tasks may already be splitting.
+ */
+static void
+MCQuantizeTop(
+    MCWorkspace *ws,
+    MCCube *cubes,
+    size_t size,
+    mc_byte_t level,
+    size_t pixels,
+    mp_workspace_t mp,
+    mc_time_t *time,
+    mc_time_t *task_times
+) {
+    if (level == 0) {
+        #pragma omp single nowait
+        MCFinishCube(ws, cubes, &task_times[cubes - ws->cubes]);
+        return;
+    }
 
-            MCShrinkCube(&cubes[offset], &t2);
-            ParallelMCQuantizeNext(&cubes[offset], size - offset, level - 1, &local_ws, &t2);
+    if (pixels < MC_SPLIT_CUTOFF) {
+        #pragma omp single nowait
+        {
+            mc_time_t *task_time = &task_times[cubes - ws->cubes];
+            #pragma omp task firstprivate(mp)
+            ParallelMCQuantizeNext(ws, cubes, size, level, &mp, task_time);
         }
+        return;
     }
 
-    MCTimeAdd(time, &t1);
-    MCTimeAdd(time, &t2);
+    size_t offset = size >> 1;
+    size_t lo_pixels = MCParallelSplit(ws, &cubes[0], &cubes[offset], pixels, time);
+    mp_workspace_t hi_mp = {
+        .counts = &mp.counts[lo_pixels / 32]
+    };
+
+    MCQuantizeTop(ws, &cubes[0], offset, level - 1, lo_pixels, mp, time, task_times);
+    MCQuantizeTop(ws, &cubes[offset], size - offset, level - 1, pixels - lo_pixels,
+                  hi_mp, time, task_times);
 }
 
 DTPalette *
@@ -453,11 +865,6 @@ MCQuantizeData(
     assert(img);
     assert(ws);
 
-    // This seems to be around the point where creating more than one thread
-    // has a real performance benefit. Images smaller than this are eaten
-    // alive by the cost of creating threads.
-    const size_t parallel_threshold = 2000000;
-
     unsigned long long ts1, ts2;
     TIMESTAMP(ts1);
 
@@ -471,18 +878,675 @@ MCQuantizeData(
        .size = size
     };
 
-    MCShrinkCube(&ws->cubes[0], time);
-    if (size >= parallel_threshold) {
-        ParallelMCQuantizeNext(ws->cubes, ws->palette->size, ws->level, &ws->mp, time);
-    } else {
-        MCQuantizeNext(ws->cubes, ws->palette->size, ws->level, &ws->mp, time);
+    ws->planes[0][0] = img->r;
+    ws->planes[0][1] = img->g;
+    ws->planes[0][2] = img->b;
+
+    mc_time_t *task_times = XMalloc(sizeof(mc_time_t) * ws->palette->size);
+    for (size_t i = 0; i < ws->palette->size; i++) {
+        MCTimeInit(&task_times[i]);
+    }
+
+    // Images too small to ever spawn a task are not worth a thread team.
+    #pragma omp parallel if (size >= MC_TASK_CUTOFF)
+    {
+        MCParallelShrinkCube(&ws->cubes[0], time);
+        MCQuantizeTop(ws, ws->cubes, ws->palette->size, ws->level, size, ws->mp, time, task_times);
     }
 
-    /* find final cube averages */
     for (size_t i = 0; i < ws->palette->size; i++) {
-        ws->palette->colors[i] = MCCubeAverage(&ws->cubes[i]);
+        MCTimeAdd(time, &task_times[i]);
+    }
+    XFree(task_times);
+
+    DTPalette *ret = ws->palette;
+    ws->palette = NULL;
+
+    TIMESTAMP(ts2);
+    time->mc_time += (ts2 - ts1);
+    time->mc_units += size;
+
+    return ret;
+}
+
+/*
+ * Histogram engine.
+ *
+ * Pixels are counted into bins of MC_HIST_BITS per channel, each also summing
+ * its pixels so that it can stand for their mean color. The non-empty bins
+ * become weighted entries, and the cubes are cut over those: every split sorts
+ * the entries of a cube along its longest side and cuts at the weighted
+ * median, so past the first pass the cost only depends on the number of
+ * distinct bins, not on the resolution.
+ *
+ * Grey pixels would only ever fill the 32 bins of the diagonal, so grey
+ * images are counted into one bin per grey level instead.
+ */
+#define MC_HIST_BITS 5
+#define MC_HIST_SIZE (1u << (3*MC_HIST_BITS))
+
+typedef struct {
+    uint64_t count;
+    uint64_t r, g, b;
+} mc_bin_t;
+
+typedef struct {
+    DTPixel color;
+    uint32_t count;
+} mc_entry_t;
+
+typedef struct {
+    DTPixel min;
+    DTPixel max;
+    size_t size;
+    uint64_t weight;
+    mc_entry_t *entries;
+} MCHistCube;
+
+/**
+ * @brief Bins of the given 16 pixels, in int16 lanes per channel.
+ */
+static inline __m256i
+MCHistKeys(
+    __m256i rgb[3]
+) {
+    const int shift = 8 - MC_HIST_BITS;
+    __m256i r = _mm256_slli_epi16(_mm256_srli_epi16(rgb[0], shift), 2*MC_HIST_BITS);
+    __m256i g = _mm256_slli_epi16(_mm256_srli_epi16(rgb[1], shift), MC_HIST_BITS);
+    __m256i b = _mm256_srli_epi16(rgb[2], shift);
+    return _mm256_or_si256(_mm256_or_si256(r, g), b);
+}
+
+/**
+ * @brief Counts every pixel of the image into bins, one private histogram per
+ *        thread, merged at the end of every block.
+ *
+ * The private bins are 32-bit, which keeps them at half the cache footprint;
+ * a block of MC_HIST_BLOCK pixels cannot overflow their sums.
+ *
+ * @return Whether any pixel has channels that differ.
+ */
+#define MC_HIST_BLOCK ((size_t) 1 << 24)
+
+typedef struct {
+    uint32_t count;
+    uint32_t r, g, b;
+} mc_local_bin_t;
+
+static bool
+MCHistogramBuild(
+    DTImage *img,
+    mc_bin_t *bins
+) {
+    const size_t size = img->resolution;
+    int colored = 0;
+
+    #pragma omp parallel reduction(|:colored)
+    {
+        mc_local_bin_t *local = XCalloc(MC_HIST_SIZE, sizeof(mc_local_bin_t));
+        __m256i diff = _mm256_setzero_si256();
+
+        for (size_t base = 0; base < size; base += MC_HIST_BLOCK) {
+            const size_t end = MIN(size, base + MC_HIST_BLOCK);
+
+            #pragma omp for schedule(static)
+            for (size_t i = base; i < end; i += 16) {
+                __m256i rgb[3];
+                if (img->gray) {
+                    rgb[0] = rgb[1] = rgb[2] = load_gray16(img->gray, (ptrdiff_t) i, end);
+                } else {
+                    load_pixels16(img->pixels, (ptrdiff_t) i, end, rgb);
+                }
+
+                diff = _mm256_or_si256(diff, _mm256_or_si256(
+                    _mm256_xor_si256(rgb[0], rgb[1]), _mm256_xor_si256(rgb[1], rgb[2])));
+
+                __attribute__((aligned(32))) uint16_t key[16], r[16], g[16], b[16];
+                _mm256_store_si256((__m256i*) key, MCHistKeys(rgb));
+                _mm256_store_si256((__m256i*) r, rgb[0]);
+                _mm256_store_si256((__m256i*) g, rgb[1]);
+                _mm256_store_si256((__m256i*) b, rgb[2]);
+
+                for (size_t k = 0; k < MIN(16, end - i); k++) {
+                    mc_local_bin_t *bin = &local[key[k]];
+                    bin->count++;
+                    bin->r += r[k];
+                    bin->g += g[k];
+                    bin->b += b[k];
+                }
+            }
+
+            #pragma omp critical
+            {
+                for (size_t k = 0; k < MC_HIST_SIZE; k++) {
+                    bins[k].count += local[k].count;
+                    bins[k].r += local[k].r;
+                    bins[k].g += local[k].g;
+                    bins[k].b += local[k].b;
+                }
+            }
+            memset(local, 0, MC_HIST_SIZE * sizeof(mc_local_bin_t));
+        }
+
+        colored |= !_mm256_testz_si256(diff, diff);
+        XFree(local);
+    }
+
+    return colored;
+}
+
+/**
+ * @brief Counts every pixel of a grey image, or of one whose channels never
+ *        differ, into one bin per grey level.
+ */
+static void
+MCGrayHistogramBuild(
+    DTImage *img,
+    uint64_t counts[256]
+) {
+    const size_t size = img->resolution;
+
+    #pragma omp parallel
+    {
+        uint64_t local[256] = { 0 };
+
+        #pragma omp for schedule(static)
+        for (size_t i = 0; i < size; i++) {
+            local[img->gray ? img->gray[i] : img->pixels[i].r]++;
+        }
+
+        #pragma omp critical
+        {
+            for (size_t v = 0; v < 256; v++) {
+                counts[v] += local[v];
+            }
+        }
+    }
+}
+
+static void
+MCHistShrinkCube(
+    MCHistCube *cube
+) {
+    cube->min = (DTPixel) { .r = 255, .g = 255, .b = 255 };
+    cube->max = (DTPixel) { .r = 0, .g = 0, .b = 0 };
+    cube->weight = 0;
+
+    for (size_t i = 0; i < cube->size; i++) {
+        DTPixel c = cube->entries[i].color;
+        cube->min.r = MIN(c.r, cube->min.r);
+        cube->min.g = MIN(c.g, cube->min.g);
+        cube->min.b = MIN(c.b, cube->min.b);
+        cube->max.r = MAX(c.r, cube->max.r);
+        cube->max.g = MAX(c.g, cube->max.g);
+        cube->max.b = MAX(c.b, cube->max.b);
+        cube->weight += cube->entries[i].count;
+    }
+}
+
+/**
+ * @brief Sorts the entries of lo along its longest side (with the same
+ *        preference as MCCalculateBiggestDimension) and splits it across the
+ *        weighted median into [lo, hi]. Entries on the median go low, unless
+ *        that leaves hi empty. A cube of a single entry cannot be split, and
+ *        leaves an empty copy of itself in hi. The split is recorded in the
+ *        given node of the split tree.
+ */
+static void
+MCHistSplit(
+    MCHistCube *lo,
+    MCHistCube *hi,
+    mc_entry_t *scratch,
+    uint32_t *node,
+    mc_time_t *time
+) {
+    unsigned long long ts1, ts2;
+    TIMESTAMP(ts1);
+
+    *hi = *lo;
+    if (lo->size < 2) {
+        hi->size = 0;
+        hi->weight = 0;
+        *node = MC_TREE_NODE(0, 255);
+        return;
+    }
+
+    // The bits of color_dim_t say which sides are at least as long as which.
+    MCCube box = { .min = lo->min, .max = lo->max };
+    color_dim_t dim = MCCalculateBiggestDimension(&box);
+    size_t channel = (dim & 0x6) == 0x6 ? 0 : (dim & 0x1) ? 1 : 2;
+
+    // Counting sort on the chosen channel, into scratch and back.
+    size_t offsets[257] = { 0 };
+    uint64_t weights[256] = { 0 };
+    for (size_t i = 0; i < lo->size; i++) {
+        const byte *c = &lo->entries[i].color.r;
+        offsets[c[channel] + 1]++;
+        weights[c[channel]] += lo->entries[i].count;
+    }
+    for (size_t v = 0; v < 256; v++) {
+        offsets[v + 1] += offsets[v];
+    }
+    for (size_t i = 0; i < lo->size; i++) {
+        const byte *c = &lo->entries[i].color.r;
+        scratch[offsets[c[channel]]++] = lo->entries[i];
+    }
+    memcpy(lo->entries, scratch, lo->size * sizeof(mc_entry_t));
+
+    // offsets[v] now ends the run of value v. Find the value holding the
+    // median pixel; a longest side of non-zero length means some entry lies
+    // below the last value, so backing off one value keeps hi non-empty.
+    uint64_t half = lo->weight >> 1, seen = 0;
+    size_t v = 0;
+    while ((seen += weights[v]) <= half) {
+        v++;
+    }
+    if (offsets[v] == lo->size) {
+        do { v--; } while (v > 0 && offsets[v] == offsets[v - 1]);
+    }
+
+    lo->size = offsets[v];
+    hi->entries += lo->size;
+    hi->size -= lo->size;
+    *node = MC_TREE_NODE(channel, v);
+
+    TIMESTAMP(ts2);
+    time->cut_time += (ts2 - ts1);
+    time->cut_units += lo->size + hi->size;
+}
+
+static void
+MCHistQuantizeNext(
+    MCHistCube *cubes,
+    size_t size,
+    mc_byte_t level,
+    uint32_t *tree,
+    size_t node,
+    mc_entry_t *scratch,
+    mc_time_t *time
+) {
+    if (level == 0) { return; }
+
+    size_t offset = size >> 1;
+    MCHistSplit(&cubes[0], &cubes[offset], scratch, &tree[node], time);
+    if (cubes[offset].size > 0) {
+        MCHistShrinkCube(&cubes[0]);
+        MCHistShrinkCube(&cubes[offset]);
+    }
+    MCHistQuantizeNext(&cubes[0], offset, level - 1, tree, 2 * node, scratch, time);
+    MCHistQuantizeNext(&cubes[offset], size - offset, level - 1, tree, 2 * node + 1,
+                       scratch, time);
+}
+
+/**
+ * @brief Color a final cube of entries stands for in the palette, weighing
+ *        every entry by its count. Empty cubes fall back to the midpoint of
+ *        their bounds.
+ */
+static DTPixel
+MCHistCubeColor(
+    const MCHistCube *cube,
+    mc_color_t color
+) {
+    if (cube->weight == 0 || color == MC_COLOR_MIDPOINT) {
+        MCCube box = { .min = cube->min, .max = cube->max };
+        return MCCubeAverage(&box);
+    }
+
+    uint64_t sum[NUM_DIM] = { 0 };
+    byte out[NUM_DIM];
+
+    if (color == MC_COLOR_MEAN) {
+        for (size_t i = 0; i < cube->size; i++) {
+            const byte *c = &cube->entries[i].color.r;
+            for (size_t d = 0; d < NUM_DIM; d++) {
+                sum[d] += (uint64_t) c[d] * cube->entries[i].count;
+            }
+        }
+        for (size_t d = 0; d < NUM_DIM; d++) {
+            out[d] = (byte) ((sum[d] + cube->weight / 2) / cube->weight);
+        }
+    } else {
+        uint64_t weights[NUM_DIM][256] = { { 0 } };
+        for (size_t i = 0; i < cube->size; i++) {
+            const byte *c = &cube->entries[i].color.r;
+            for (size_t d = 0; d < NUM_DIM; d++) {
+                weights[d][c[d]] += cube->entries[i].count;
+            }
+        }
+        const uint64_t half = cube->weight >> 1;
+        for (size_t d = 0; d < NUM_DIM; d++) {
+            size_t v = 0;
+            while ((sum[d] += weights[d][v]) <= half && v < 255) {
+                v++;
+            }
+            out[d] = (byte) v;
+        }
+    }
+
+    return (DTPixel) { .r = out[0], .g = out[1], .b = out[2] };
+}
+
+/**
+ * @brief Cuts the palette of the workspace over the given entries, with
+ *        scratch room for as many.
+ */
+static void
+MCHistQuantize(
+    MCWorkspace *ws,
+    mc_entry_t *entries,
+    mc_entry_t *scratch,
+    size_t count,
+    mc_time_t *time
+) {
+    MCHistCube *cubes = XMalloc(sizeof(MCHistCube) * ws->palette->size);
+    cubes[0] = (MCHistCube) { .entries = entries, .size = count };
+    MCHistShrinkCube(&cubes[0]);
+    MCHistQuantizeNext(cubes, ws->palette->size, ws->level, ws->tree, 1, scratch, time);
+
+    /* find final cube colors */
+    MC_TIME(
+        time->color,
+        count,
+        for (size_t i = 0; i < ws->palette->size; i++) {
+            ws->palette->colors[i] = MCHistCubeColor(&cubes[i], ws->color);
+        }
+    );
+
+    XFree(cubes);
+}
+
+DTPalette *
+MCQuantizeHistogram(
+    DTImage *img,
+    MCWorkspace *ws,
+    mc_time_t *time
+) {
+    assert(img);
+    assert(ws);
+
+    unsigned long long ts1, ts2, hs1, hs2;
+    TIMESTAMP(ts1);
+
+    mc_bin_t *bins = XCalloc(MC_HIST_SIZE, sizeof(mc_bin_t));
+    uint64_t grays[256] = { 0 };
+    TIMESTAMP(hs1);
+    bool gray = img->gray || !MCHistogramBuild(img, bins);
+    if (gray) {
+        MCGrayHistogramBuild(img, grays);
+    }
+    TIMESTAMP(hs2);
+    time->hist_time += (hs2 - hs1);
+    time->hist_units += img->resolution;
+
+    // Every non-empty bin becomes an entry of its mean color, or of its grey
+    // level.
+    mc_entry_t *entries = XMalloc(MC_HIST_SIZE * sizeof(mc_entry_t));
+    mc_entry_t *scratch = XMalloc(MC_HIST_SIZE * sizeof(mc_entry_t));
+    size_t count = 0;
+    for (size_t v = 0; gray && v < 256; v++) {
+        if (grays[v] > 0) {
+            entries[count++] = (mc_entry_t) {
+                .color = { .r = (byte) v, .g = (byte) v, .b = (byte) v },
+                .count = (uint32_t) grays[v]
+            };
+        }
+    }
+    for (size_t k = 0; !gray && k < MC_HIST_SIZE; k++) {
+        uint64_t n = bins[k].count;
+        if (n == 0) {
+            continue;
+        }
+        entries[count++] = (mc_entry_t) {
+            .color = {
+                .r = (byte) ((bins[k].r + n/2) / n),
+                .g = (byte) ((bins[k].g + n/2) / n),
+                .b = (byte) ((bins[k].b + n/2) / n)
+            },
+            .count = (uint32_t) n
+        };
+    }
+    XFree(bins);
+
+    MCHistQuantize(ws, entries, scratch, count, time);
+    XFree(entries);
+    XFree(scratch);
+
+    DTPalette *ret = ws->palette;
+    ws->palette = NULL;
+
+    TIMESTAMP(ts2);
+    time->mc_time += (ts2 - ts1);
+    time->mc_units += img->resolution;
+
+    return ret;
+}
+
+/*
+ * Sort engine.
+ *
+ * Every pixel gets a 24-bit key of its color, and the keys are sorted with a
+ * parallel LSD radix sort, a byte per pass. Runs of equal keys then become the
+ * weighted entries of the histogram engine, at full precision: cubes are cut
+ * over the distinct colors of the image, and no split touches the pixels.
+ *
+ * Each pass counts its digit by block, turns the counts into where every
+ * block's share of every digit goes, and scatters the blocks in order, so
+ * the sort is stable without any thread knowing how many others there are.
+ */
+#define MC_SORT_BLOCK ((size_t) 1 << 16)
+
+typedef struct {
+    uint32_t count[256];
+} mc_radix_block_t;
+
+/**
+ * @brief Sorts the colors of the image as keys of (r << 16) | (g << 8) | b.
+ *
+ * The first pass reads the planes of the image and builds the keys as it
+ * scatters them. Later passes whose digit is the same for every pixel, such
+ * as a green or red channel that never changes, are skipped; grey pixels vary
+ * in every digit and take all three passes.
+ *
+ * @return The buffer holding the sorted keys, keys or tmp.
+ */
+static uint32_t *
+MCRadixSort(
+    SplitImage *img,
+    uint32_t *keys,
+    uint32_t *tmp,
+    mc_radix_block_t *blocks,
+    size_t size
+) {
+    const size_t nblocks = (size + MC_SORT_BLOCK - 1) / MC_SORT_BLOCK;
+    uint32_t *src = tmp, *dst = keys;
+    bool skip = false;
+
+    #pragma omp parallel if (size >= MC_TASK_CUTOFF)
+    for (unsigned int pass = 0; pass < 3; pass++) {
+        const unsigned int shift = 8 * pass;
+
+        #pragma omp for schedule(static)
+        for (size_t k = 0; k < nblocks; k++) {
+            const size_t begin = k * MC_SORT_BLOCK;
+            const size_t end = MIN(size, begin + MC_SORT_BLOCK);
+            uint32_t *count = blocks[k].count;
+            memset(count, 0, sizeof(blocks[k].count));
+            if (pass == 0) {
+                for (size_t i = begin; i < end; i++) count[img->b[i]]++;
+            } else {
+                for (size_t i = begin; i < end; i++) count[(src[i] >> shift) & 0xFF]++;
+            }
+        }
+
+        #pragma omp single
+        {
+            uint32_t pos = 0;
+            skip = false;
+            for (size_t d = 0; d < 256; d++) {
+                uint32_t start = pos;
+                for (size_t k = 0; k < nblocks; k++) {
+                    uint32_t n = blocks[k].count[d];
+                    blocks[k].count[d] = pos;
+                    pos += n;
+                }
+                skip |= (pass > 0) && (pos - start == size);
+            }
+        }
+
+        if (!skip) {
+            #pragma omp for schedule(static)
+            for (size_t k = 0; k < nblocks; k++) {
+                const size_t begin = k * MC_SORT_BLOCK;
+                const size_t end = MIN(size, begin + MC_SORT_BLOCK);
+                uint32_t *pos = blocks[k].count;
+                if (pass == 0) {
+                    for (size_t i = begin; i < end; i++) {
+                        uint32_t key = ((uint32_t) img->r[i] << 16) |
+                                       ((uint32_t) img->g[i] << 8) | img->b[i];
+                        dst[pos[img->b[i]]++] = key;
+                    }
+                } else {
+                    for (size_t i = begin; i < end; i++) {
+                        uint32_t key = src[i];
+                        dst[pos[(key >> shift) & 0xFF]++] = key;
+                    }
+                }
+            }
+
+            #pragma omp single
+            {
+                uint32_t *t = src;
+                src = dst;
+                dst = t;
+            }
+        }
+    }
+
+    return src;
+}
+
+/**
+ * @brief Finds where the first run of equal keys starting at or after begin
+ *        starts, skipping the end of a run that started before it.
+ */
+static inline size_t
+MCRunStart(
+    const uint32_t *keys,
+    size_t begin,
+    size_t end
+) {
+    while (begin > 0 && begin < end && keys[begin] == keys[begin - 1]) {
+        begin++;
+    }
+    return begin;
+}
+
+/**
+ * @brief Turns the runs of equal sorted keys into entries, by block: each
+ *        block counts the runs that start in it, then writes them.
+ * @param entries Returns the entries, as many as the return value.
+ * @return The number of distinct colors.
+ */
+static size_t
+MCRunEntries(
+    const uint32_t *keys,
+    size_t size,
+    mc_radix_block_t *blocks,
+    mc_entry_t **entries
+) {
+    const size_t nblocks = (size + MC_SORT_BLOCK - 1) / MC_SORT_BLOCK;
+    size_t count = 0;
+    mc_entry_t *out = NULL;
+
+    #pragma omp parallel if (size >= MC_TASK_CUTOFF)
+    {
+        #pragma omp for schedule(static)
+        for (size_t k = 0; k < nblocks; k++) {
+            const size_t end = MIN(size, (k + 1) * MC_SORT_BLOCK);
+            uint32_t runs = 0;
+            for (size_t i = MCRunStart(keys, k * MC_SORT_BLOCK, end); i < end; i++) {
+                runs += (i == 0) || (keys[i] != keys[i - 1]);
+            }
+            blocks[k].count[0] = runs;
+        }
+
+        #pragma omp single
+        {
+            for (size_t k = 0; k < nblocks; k++) {
+                uint32_t runs = blocks[k].count[0];
+                blocks[k].count[0] = (uint32_t) count;
+                count += runs;
+            }
+            out = XMalloc(count * sizeof(mc_entry_t));
+        }
+
+        #pragma omp for schedule(static)
+        for (size_t k = 0; k < nblocks; k++) {
+            const size_t end = MIN(size, (k + 1) * MC_SORT_BLOCK);
+            mc_entry_t *e = &out[blocks[k].count[0]];
+            size_t i = MCRunStart(keys, k * MC_SORT_BLOCK, end);
+            while (i < end) {
+                size_t j = i + 1;
+                while (j < size && keys[j] == keys[i]) j++;
+                *e++ = (mc_entry_t) {
+                    .color = {
+                        .r = (byte) (keys[i] >> 16),
+                        .g = (byte) (keys[i] >> 8),
+                        .b = (byte) keys[i]
+                    },
+                    .count = (uint32_t) (j - i)
+                };
+                i = j;
+            }
+        }
     }
 
+    *entries = out;
+    return count;
+}
+
+DTPalette *
+MCQuantizeSorted(
+    SplitImage *img,
+    MCWorkspace *ws,
+    mc_time_t *time
+) {
+    assert(img);
+    assert(ws);
+
+    unsigned long long ts1, ts2;
+    TIMESTAMP(ts1);
+
+    const size_t size = img->w * img->h;
+    const size_t nblocks = (size + MC_SORT_BLOCK - 1) / MC_SORT_BLOCK;
+    mc_radix_block_t *blocks = XMalloc(nblocks * sizeof(mc_radix_block_t));
+    uint32_t *keys = XMalloc(size * sizeof(uint32_t));
+    uint32_t *tmp = XMalloc(size * sizeof(uint32_t));
+
+    uint32_t *sorted;
+    MC_TIME(
+        time->sort,
+        size,
+        sorted = MCRadixSort(img, keys, tmp, blocks, size);
+    );
+
+    mc_entry_t *entries;
+    size_t count;
+    MC_TIME(
+        time->hist,
+        size,
+        count = MCRunEntries(sorted, size, blocks, &entries);
+    );
+    XFree(keys);
+    XFree(tmp);
+    XFree(blocks);
+
+    mc_entry_t *scratch = XMalloc(count * sizeof(mc_entry_t));
+    MCHistQuantize(ws, entries, scratch, count, time);
+    XFree(entries);
+    XFree(scratch);
+
     DTPalette *ret = ws->palette;
     ws->palette = NULL;
 
@@ -493,6 +1557,90 @@ MCQuantizeData(
     return ret;
 }
 
+/**
+ * @brief Walks 8 packed colors down the split tree at once, one gather per
+ *        level.
+ */
+static inline __m256i
+MCTreeDescend(
+    const uint32_t *tree,
+    mc_byte_t level,
+    __m256i colors
+) {
+    const __m256i byte_mask = _mm256_set1_epi32(0xff);
+    __m256i node = _mm256_set1_epi32(1);
+    for (mc_byte_t l = 0; l < level; l++) {
+        __m256i split = _mm256_i32gather_epi32((const int*) tree, node, 4);
+        __m256i value = _mm256_and_si256(
+            _mm256_srlv_epi32(colors, _mm256_srli_epi32(split, 8)), byte_mask);
+        __m256i hi = _mm256_cmpgt_epi32(value, _mm256_and_si256(split, byte_mask));
+        node = _mm256_sub_epi32(_mm256_add_epi32(node, node), hi);
+    }
+    return _mm256_sub_epi32(node, _mm256_set1_epi32(1 << level));
+}
+
+/**
+ * @brief Packs 8 pixels of 16 int16 lanes per channel into r | g << 8 |
+ *        b << 16 colors, from the low or high half of the lanes.
+ */
+static inline __m256i
+MCPackColors(
+    __m256i rgb[3],
+    int half
+) {
+    __m128i ch[3];
+    for (size_t c = 0; c < NUM_DIM; c++) {
+        ch[c] = half ? _mm256_extracti128_si256(rgb[c], 1) : _mm256_castsi256_si128(rgb[c]);
+    }
+    __m256i r = _mm256_cvtepu16_epi32(ch[0]);
+    __m256i g = _mm256_slli_epi32(_mm256_cvtepu16_epi32(ch[1]), 8);
+    __m256i b = _mm256_slli_epi32(_mm256_cvtepu16_epi32(ch[2]), 16);
+    return _mm256_or_si256(_mm256_or_si256(r, g), b);
+}
+
+void
+MCIndexMap(
+    const MCWorkspace *ws,
+    const DTImage *img,
+    uint16_t *indices,
+    mc_time_t *time
+) {
+    assert(ws);
+    assert(img);
+    assert(indices);
+
+    unsigned long long ts1, ts2;
+    TIMESTAMP(ts1);
+
+    const size_t size = img->resolution;
+
+    #pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < size; i += 16) {
+        __m256i rgb[3];
+        if (img->gray) {
+            rgb[0] = rgb[1] = rgb[2] = load_gray16(img->gray, (ptrdiff_t) i, size);
+        } else {
+            load_pixels16(img->pixels, (ptrdiff_t) i, size, rgb);
+        }
+
+        __m256i lo = MCTreeDescend(ws->tree, ws->level, MCPackColors(rgb, 0));
+        __m256i hi = MCTreeDescend(ws->tree, ws->level, MCPackColors(rgb, 1));
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(lo, hi), 0xD8);
+
+        if (i + 16 <= size) {
+            _mm256_storeu_si256((__m256i*) &indices[i], packed);
+        } else {
+            __attribute__((aligned(32))) uint16_t tail[16];
+            _mm256_store_si256((__m256i*) tail, packed);
+            memcpy(&indices[i], tail, (size - i) * sizeof(uint16_t));
+        }
+    }
+
+    TIMESTAMP(ts2);
+    time->map_time += (ts2 - ts1);
+    time->map_units += size;
+}
+
 void
 MCTimeInit(
     mc_time_t *time
@@ -539,17 +1687,62 @@ MCTimeReport(
     double sub_pix = ((double)time->sub_units) / sub_time;
     double sub_peak = (sub_pix / sub_theoretical) * 100;
 
+    double count_time = TIME_NORM(0, time->count_time);
+    double count_pix = ((double)time->count_units) / count_time;
+
+    double gather_time = TIME_NORM(0, time->gather_time);
+    double gather_pix = ((double)time->gather_units) / gather_time;
+
+    double color_time = TIME_NORM(0, time->color_time);
+    double color_pix = ((double)time->color_units) / color_time;
+
+    double map_time = TIME_NORM(0, time->map_time);
+    double map_pix = ((double)time->map_units) / map_time;
+
     double shrink_time = TIME_NORM(0, time->shrink_time);
     double shrink_pix = ((double)time->shrink_units) / shrink_time;
     double shrink_peak = (shrink_pix / shrink_theoretical) * 100;
 
     printf("Kernel%19sCycles%14sPix/cyc%13s%%Peak\n", "", "", "");
     printf("MCQuantization%11s%-20.6lf%-20.6lf%.2lf%%\n", "", mc_time, mc_pix, mc_peak);
+
+    // The histogram and sort engines never touch the partition kernels; their
+    // cut is reported per histogram entry rather than per pixel.
+    if (time->hist_units > 0) {
+        double hist_time = TIME_NORM(0, time->hist_time);
+        double hist_pix = ((double)time->hist_units) / hist_time;
+        double cut_time = TIME_NORM(0, time->cut_time);
+        double cut_ent = ((double)time->cut_units) / cut_time;
+        if (time->sort_units > 0) {
+            double sort_time = TIME_NORM(0, time->sort_time);
+            double sort_pix = ((double)time->sort_units) / sort_time;
+            printf(" Radix Sort%14s%-20.6lf%-20.6lf\n", "", sort_time, sort_pix);
+        }
+        printf(" Histogram%15s%-20.6lf%-20.6lf\n", "", hist_time, hist_pix);
+        printf(" Histogram Cut%11s%-20.6lf%-20.6lf(entries)\n", "", cut_time, cut_ent);
+        printf(" Cube Color%14s%-20.6lf%-20.6lf(entries)\n", "", color_time, color_pix);
+        if (time->map_units > 0) {
+            printf("Index Map%16s%-20.6lf%-20.6lf\n", "", map_time, map_pix);
+        }
+        return;
+    }
+
     printf(" Split%19s%-20.6lf%-20.6lf%.2lf%%\n", "", split_time, split_pix, split_peak);
     printf(" Median Partition%8s%-20.6lf%-20.6lf%.2lf%%\n", "", mid_time, mid_pix, mid_peak);
+    printf("  Median Count%11s%-20.6lf%-20.6lf\n", "", count_time, count_pix);
     printf("  Partition%14s%-20.6lf%-20.6lf%.2lf%%\n", "", part_time, part_pix, part_peak);
     printf("   Align Partition%7s%-20.6lf%-20.6lf%.2lf%%\n", "", align_time, align_pix, align_peak);
     printf("    Align Full-Partition%1s%-20.6lf%-20.6lf%.2lf%%\n", "", full_time, full_pix, full_peak);
     printf("    Align Sub-Partition%2s%-20.6lf%-20.6lf%.2lf%%\n", "", sub_time, sub_pix, sub_peak);
+    printf("  Median Gather%10s%-20.6lf%-20.6lf\n", "", gather_time, gather_pix);
     printf(" Shrink%18s%-20.6lf%-20.6lf%.2lf%%\n", "", shrink_time, shrink_pix, shrink_peak);
+    printf(" Cube Color%14s%-20.6lf%-20.6lf\n", "", color_time, color_pix);
+    if (time->map_units > 0) {
+        printf("Index Map%16s%-20.6lf%-20.6lf\n", "", map_time, map_pix);
+    }
+
+    // Bytes read and written by the partitions of each split, over its pixels.
+    double moved_split = ((double)time->moved_bytes) / ((double)time->splits);
+    double moved_pix = ((double)time->moved_bytes) / ((double)time->mid_units);
+    printf("Moved/Split%14s%-20.0lf%.2lf B/pix\n", "", moved_split, moved_pix);
 }
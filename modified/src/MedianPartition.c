@@ -13,6 +13,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <stdbool.h>
 
 #include <immintrin.h>
@@ -21,6 +22,12 @@
 #include <XMalloc.h>
 #include <CompilerGoop.h>
 
+#ifndef MP_GATHER_RATIO
+/// @brief Median values are gathered by swaps, rather than a second
+///        partition, when at most one in this many low elements must move.
+#define MP_GATHER_RATIO 4
+#endif
+
 /*** Special look-up table for partition. Only used in this file. ***/
 #include <sort_lut.h>
 
@@ -171,8 +178,8 @@ __attribute__((aligned (32))) static const uint8_t rrl_shuffle_hi[16][32] = {
         "vmovq %3, %%xmm0\n\t"\
         "vpor %%ymm0, %1, %1\n\t"\
         "vpunpcklqdq %1, %0, %0"\
-        : "=x" (_ret),\
-          "=x" (_tmp)\
+        : "=&x" (_ret),\
+          "=&x" (_tmp)\
         : "m" (*i0),\
           "m" (*i1),\
           "m" (*((i2) - 2)),\
@@ -188,10 +195,10 @@ __attribute__((aligned (32))) static const uint8_t rrl_shuffle_hi[16][32] = {
 ({\
     register __m256i _ret;\
     __asm__ (\
-        "movdqa %1, %%xmm0\n\t"\
+        "vmovdqa %1, %%xmm0\n\t"\
         "vpmaskmovq %2, %3, %0\n\t"\
         "vpor %%ymm0, %0, %0\n\t"\
-        : "=x" (_ret)\
+        : "=&x" (_ret)\
         : "m" (*i0),\
           "m" (* (__m256i*) ((i1) - 1)),\
           "x" (h)\
@@ -200,6 +207,173 @@ __attribute__((aligned (32))) static const uint8_t rrl_shuffle_hi[16][32] = {
     _ret;\
 })
 
+/** @brief Empties the given bounds, so that any element grows them. */
+static inline void
+MPBoundsInit(
+    mp_bounds_t *b
+) {
+    memset(b->lo_min, 0xFF, 3);
+    memset(b->hi_min, 0xFF, 3);
+    memset(b->lo_max, 0, 3);
+    memset(b->hi_max, 0, 3);
+}
+
+/**
+ * @brief Grows the running min/max vectors of one side with the channel
+ *        vectors, leaving out the elements set in skip.
+ */
+static inline void
+MPGrowVectors(
+    __m256i *min,
+    __m256i *max,
+    const __m256i *v,
+    size_t channels,
+    __m256i skip
+) {
+    for (size_t c = 0; c < channels; c++) {
+        min[c] = _mm256_min_epu8(min[c], _mm256_or_si256(v[c], skip));
+        max[c] = _mm256_max_epu8(max[c], _mm256_andnot_si256(skip, v[c]));
+    }
+}
+
+/** @brief Reduces the running min/max vectors of one side into min/max. */
+static inline void
+MPReduceVectors(
+    uint8_t *min,
+    uint8_t *max,
+    const __m256i *vmin,
+    const __m256i *vmax,
+    size_t channels
+) {
+    for (size_t c = 0; c < channels; c++) {
+        __m128i lo = _mm_min_epu8(_mm256_castsi256_si128(vmin[c]),
+                                  _mm256_extracti128_si256(vmin[c], 1));
+        __m128i hi = _mm_max_epu8(_mm256_castsi256_si128(vmax[c]),
+                                  _mm256_extracti128_si256(vmax[c], 1));
+        lo = _mm_min_epu8(lo, _mm_srli_si128(lo, 8));
+        hi = _mm_max_epu8(hi, _mm_srli_si128(hi, 8));
+        lo = _mm_min_epu8(lo, _mm_srli_si128(lo, 4));
+        hi = _mm_max_epu8(hi, _mm_srli_si128(hi, 4));
+        lo = _mm_min_epu8(lo, _mm_srli_si128(lo, 2));
+        hi = _mm_max_epu8(hi, _mm_srli_si128(hi, 2));
+        lo = _mm_min_epu8(lo, _mm_srli_si128(lo, 1));
+        hi = _mm_max_epu8(hi, _mm_srli_si128(hi, 1));
+        min[c] = MIN(min[c], (uint8_t) _mm_cvtsi128_si32(lo));
+        max[c] = MAX(max[c], (uint8_t) _mm_cvtsi128_si32(hi));
+    }
+}
+
+/**
+ * @brief Grows the bounds of the second and third channels on either side of
+ *        a partition across the pivot with the elements [begin, end), one at
+ *        a time. Elements equal to the pivot belong to neither side.
+ */
+static void
+MPGrowScalar(
+    const uint8_t *ch1,
+    const uint8_t *ch2,
+    const uint8_t *ch3,
+    size_t begin,
+    size_t end,
+    uint8_t pivot,
+    mp_bounds_t *b
+) {
+    for (size_t i = begin; i < end; i++) {
+        if (ch1[i] == pivot) continue;
+        uint8_t *min = (ch1[i] < pivot) ? b->lo_min : b->hi_min;
+        uint8_t *max = (ch1[i] < pivot) ? b->lo_max : b->hi_max;
+        min[1] = MIN(min[1], ch2[i]);
+        min[2] = MIN(min[2], ch3[i]);
+        max[1] = MAX(max[1], ch2[i]);
+        max[2] = MAX(max[2], ch3[i]);
+    }
+}
+
+/**
+ * @brief Grows the bounds as MPGrowScalar does with the first pre and the last
+ *        post elements, which the aligned partition leaves out, from one
+ *        masked vector at either end. The channels must hold at least 32 elements.
+ */
+static void
+MPGrowEdges(
+    const uint8_t *ch1,
+    const uint8_t *ch2,
+    const uint8_t *ch3,
+    size_t size,
+    size_t pre,
+    size_t post,
+    uint8_t pivot,
+    mp_bounds_t *b
+) {
+    const __m256i pivots = _mm256_set1_epi8((char) pivot);
+    const __m256i lanes = _mm256_setr_epi8(
+        0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+        16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31
+    );
+    const size_t base[2] = { 0, size - 32 };
+    const __m256i in[2] = {
+        _mm256_cmpgt_epi8(_mm256_set1_epi8((char) pre), lanes),
+        _mm256_cmpgt_epi8(lanes, _mm256_set1_epi8((char) (31 - post)))
+    };
+
+    __m256i lo_min[2], lo_max[2], hi_min[2], hi_max[2];
+    lo_min[0] = lo_min[1] = hi_min[0] = hi_min[1] = _mm256_set1_epi8((char) 0xFF);
+    lo_max[0] = lo_max[1] = hi_max[0] = hi_max[1] = _mm256_setzero_si256();
+
+    for (size_t e = 0; e < 2; e++) {
+        __m256i v1 = _mm256_loadu_si256((const __m256i*) &ch1[base[e]]);
+        __m256i v[2] = {
+            _mm256_loadu_si256((const __m256i*) &ch2[base[e]]),
+            _mm256_loadu_si256((const __m256i*) &ch3[base[e]])
+        };
+        __m256i top = _mm256_max_epu8(v1, pivots);
+        __m256i skip = _mm256_cmpeq_epi8(in[e], _mm256_setzero_si256());
+        MPGrowVectors(lo_min, lo_max, v, 2,
+                      _mm256_or_si256(skip, _mm256_cmpeq_epi8(top, v1)));
+        MPGrowVectors(hi_min, hi_max, v, 2,
+                      _mm256_or_si256(skip, _mm256_cmpeq_epi8(top, pivots)));
+    }
+
+    MPReduceVectors(&b->lo_min[1], &b->lo_max[1], lo_min, lo_max, 2);
+    MPReduceVectors(&b->hi_min[1], &b->hi_max[1], hi_min, hi_max, 2);
+}
+
+/**
+ * @brief Grows the bounds of the second and third channels with every
+ *        element of [begin, end), 32 at a time.
+ */
+static void
+MPGrowRange(
+    const uint8_t *ch2,
+    const uint8_t *ch3,
+    size_t begin,
+    size_t end,
+    uint8_t min[3],
+    uint8_t max[3]
+) {
+    size_t i = begin;
+    if (i + 32 <= end) {
+        __m256i vmin[2], vmax[2];
+        vmin[0] = vmin[1] = _mm256_set1_epi8((char) 0xFF);
+        vmax[0] = vmax[1] = _mm256_setzero_si256();
+        for (; i + 32 <= end; i += 32) {
+            __m256i v[2] = {
+                _mm256_loadu_si256((const __m256i*) &ch2[i]),
+                _mm256_loadu_si256((const __m256i*) &ch3[i])
+            };
+            MPGrowVectors(vmin, vmax, v, 2, _mm256_setzero_si256());
+        }
+        MPReduceVectors(&min[1], &max[1], vmin, vmax, 2);
+    }
+
+    for (; i < end; i++) {
+        min[1] = MIN(min[1], ch2[i]);
+        min[2] = MIN(min[2], ch3[i]);
+        max[1] = MAX(max[1], ch2[i]);
+        max[2] = MAX(max[2], ch3[i]);
+    }
+}
+
 /**
  * @brief Sub-partitions the given arrays.
  * @param ws The MedianPartition workspace for this partition.
@@ -396,11 +570,19 @@ AlignSubPartition32(
 
 /**
  * @brief Fully partitions the given sub-partitioned arrays.
+ *
+ * Every vector is stored exactly once, and all of it on one side but the
+ * last, so the bounds of the second and third channels on both sides come
+ * from the registers on the way out.
+ *
  * @param ws The MedianPartition workspace for this partition.
  * @param ch1 The first channel to partition across.
  * @param ch2 The second channel to partition across.
  * @param ch3 The third channel to partition across.
  * @param size The size of each channel.
+ * @param pivot The value partitioned across.
+ * @param bounds If not NULL, grown with the second and third channels of the
+ *               elements on either side, except those equal to the pivot.
  */
 static size_t
 AlignFullPartition(
@@ -408,12 +590,22 @@ AlignFullPartition(
     __m256i *ch1,
     __m256i *ch2,
     __m256i *ch3,
-    size_t size
+    size_t size,
+    uint8_t pivot,
+    mp_bounds_t *bounds
 ) {
     register __m256i a1, a2, a3, b1, b2, b3;
     register uint32_t ac, bc;
     size_t lo = 0, hi = size - 1, next = size - 1;
 
+    const __m256i pivots = _mm256_set1_epi8((char) pivot);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i lo_min[2], lo_max[2], hi_min[2], hi_max[2];
+    for (size_t c = 0; c < 2; c++) {
+        lo_min[c] = hi_min[c] = _mm256_cmpeq_epi8(zero, zero);
+        lo_max[c] = hi_max[c] = zero;
+    }
+
     a1 = _mm256_load_si256(&ch1[0]);
     a2 = _mm256_load_si256(&ch2[0]);
     a3 = _mm256_load_si256(&ch3[0]);
@@ -499,6 +691,10 @@ AlignFullPartition(
         // low values and should be stored. Otherwise, the b vectors are all
         // high values and should be stored.
         if (ac == 0) {
+            if (bounds) {
+                __m256i v[2] = { a2, a3 };
+                MPGrowVectors(lo_min, lo_max, v, 2, _mm256_cmpeq_epi8(a1, pivots));
+            }
             _mm256_store_si256(&ch1[lo], a1);
             _mm256_store_si256(&ch2[lo], a2);
             _mm256_store_si256(&ch3[lo], a3);
@@ -508,6 +704,10 @@ AlignFullPartition(
             ac = bc;
             next = ++lo;
         } else {
+            if (bounds) {
+                __m256i v[2] = { b2, b3 };
+                MPGrowVectors(hi_min, hi_max, v, 2, zero);
+            }
             _mm256_store_si256(&ch1[hi], b1);
             _mm256_store_si256(&ch2[hi], b2);
             _mm256_store_si256(&ch3[hi], b3);
@@ -519,6 +719,16 @@ AlignFullPartition(
     _mm256_store_si256(&ch2[lo], a2);
     _mm256_store_si256(&ch3[lo], a3);
 
+    // The last vector holds the crossing, so each element is checked.
+    if (bounds) {
+        __m256i v[2] = { a2, a3 };
+        __m256i top = _mm256_max_epu8(a1, pivots);
+        MPGrowVectors(lo_min, lo_max, v, 2, _mm256_cmpeq_epi8(top, a1));
+        MPGrowVectors(hi_min, hi_max, v, 2, _mm256_cmpeq_epi8(top, pivots));
+        MPReduceVectors(&bounds->lo_min[1], &bounds->lo_max[1], lo_min, lo_max, 2);
+        MPReduceVectors(&bounds->hi_min[1], &bounds->hi_max[1], hi_min, hi_max, 2);
+    }
+
     return lo;
 }
 
@@ -531,6 +741,7 @@ AlignFullPartition(
  * @param ch3 The third array to be partitioned, moved the same as ch1.
  * @param size The size of each channel, in 32-byte chunks.
  * @param pivot The value to pivot across.
+ * @param bounds If not NULL, grown as in AlignFullPartition.
  * @return The index of the vector containing the pivot crossing.
  */
 static size_t
@@ -541,6 +752,7 @@ AlignPartition(
     __m256i *ch3,
     size_t size,
     uint8_t pivot,
+    mp_bounds_t *bounds,
     mc_time_t *time
 ) {
     assert(size > 0);
@@ -557,7 +769,7 @@ AlignPartition(
     MC_TIME(
         time->full,
         size * 32,
-        ret = AlignFullPartition(ws, ch1, ch2, ch3, size);
+        ret = AlignFullPartition(ws, ch1, ch2, ch3, size, pivot, bounds);
     );
 
     return ret;
@@ -593,6 +805,13 @@ SinglePartition1X32(
     _mm256_storeu_si256(ch3, ch[2]);
 }
 
+/**
+ * @brief Partitions the channels across the pivot, in place.
+ * @param bounds If not NULL, the second and third channels are grown with the
+ *               elements below the pivot on the low side and those above it
+ *               on the high side. Elements equal to the pivot are left out.
+ * @return The number of elements up to the pivot.
+ */
 static size_t
 Partition(
     mp_workspace_t *ws,
@@ -601,6 +820,7 @@ Partition(
     uint8_t *ch3,
     size_t size,
     uint8_t pivot,
+    mp_bounds_t *bounds,
     mc_time_t *time
 ) {
     // Get the offsets necessary to align the size and arrays to a 32-byte
@@ -615,6 +835,11 @@ Partition(
     if ((pre_align + post_align) < size) {
         size_t align_size = (size - (pre_align + post_align)) / 32;
 
+        // The unaligned ends are only shuffled around afterwards.
+        if (bounds && (pre_align + post_align) > 0) {
+            MPGrowEdges(ch1, ch2, ch3, size, pre_align, post_align, pivot, bounds);
+        }
+
         MC_TIME(
             time->align,
             align_size * 32,
@@ -625,6 +850,7 @@ Partition(
                 (__m256i*) &ch3[pre_align],
                 align_size,
                 pivot,
+                bounds,
                 time
             );
         );
@@ -693,6 +919,10 @@ Partition(
         _mm256_storeu_si256((__m256i*) &ch2[target], u2);
         _mm256_storeu_si256((__m256i*) &ch3[target], u3);
     } else {
+        if (bounds) {
+            MPGrowScalar(ch1, ch2, ch3, 0, size, pivot, bounds);
+        }
+
         size_t lo = 0, hi = size;
         while (lo < hi) {
             if (ch1[lo] > pivot) {
@@ -725,68 +955,124 @@ Partition(
 }
 
 /**
- * @brief Selects the kth sorted element in the given array.
- * @param ch1 The channel to search for the kth element of.
- * @param ch2 The first channel to arg-partition with ch1.
- * @param ch3 The second channel to arg-partition with ch2.
- * @param size The size of the array.
- * @param k The k index to search for.
- * @param time The time measured for partition.
- * @return The median for channel 1.
+ * @brief Counts the values of an array into a 256-bin histogram, reading it
+ *        32 bytes at a time.
+ *
+ * Consecutive bytes go to four interleaved tables, so runs of the same value
+ * do not serialize on a single counter.
  */
-static uint8_t
-QSelect(
-    mp_workspace_t *ws,
+static void
+MPCount(
+    uint32_t hist[256],
+    const uint8_t *ch,
+    size_t size
+) {
+    uint32_t sub[4][256];
+    memset(sub, 0, sizeof(sub));
+
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) &ch[i]);
+        uint64_t q[4] = {
+            (uint64_t) _mm256_extract_epi64(v, 0),
+            (uint64_t) _mm256_extract_epi64(v, 1),
+            (uint64_t) _mm256_extract_epi64(v, 2),
+            (uint64_t) _mm256_extract_epi64(v, 3)
+        };
+
+        for (size_t j = 0; j < 4; j++) {
+            sub[0][q[j] & 0xFF]++;
+            sub[1][(q[j] >> 8) & 0xFF]++;
+            sub[2][(q[j] >> 16) & 0xFF]++;
+            sub[3][(q[j] >> 24) & 0xFF]++;
+            sub[0][(q[j] >> 32) & 0xFF]++;
+            sub[1][(q[j] >> 40) & 0xFF]++;
+            sub[2][(q[j] >> 48) & 0xFF]++;
+            sub[3][q[j] >> 56]++;
+        }
+    }
+    for (; i < size; i++) {
+        sub[0][ch[i]]++;
+    }
+
+    for (size_t v = 0; v < 256; v++) {
+        hist[v] = sub[0][v] + sub[1][v] + sub[2][v] + sub[3][v];
+    }
+}
+
+/**
+ * @brief Marks the elements of ch[base, MIN(base + 32, end)) that are equal
+ *        to the given value, or not equal to it when flip is set.
+ */
+static inline uint32_t
+MPMatch(
+    const uint8_t *ch,
+    size_t base,
+    size_t end,
+    __m256i value,
+    uint32_t flip
+) {
+    if (base + 32 <= end) {
+        __m256i x = _mm256_loadu_si256((const __m256i*) &ch[base]);
+        return ((uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, value))) ^ flip;
+    }
+
+    uint8_t v = (uint8_t) _mm256_extract_epi8(value, 0);
+    uint32_t mask = 0;
+    for (size_t i = base; i < end; i++) {
+        mask |= (uint32_t) (ch[i] == v) << (i - base);
+    }
+    return (mask ^ flip) & ((1u << (end - base)) - 1);
+}
+
+/**
+ * @brief Completes a partition across the median into three parts.
+ *
+ * After Partition across the median, [0, lo_size) holds the elements up to
+ * the median in any order. The below elements less than it are brought to the
+ * front by swapping each median value found there with a lesser element from
+ * [below, lo_size). Only the first channel is compared, 32 elements at a
+ * time, and only misplaced elements move.
+ *
+ * @return The bytes read and written.
+ */
+static size_t
+GatherMedian(
     uint8_t *ch1,
     uint8_t *ch2,
     uint8_t *ch3,
-    size_t size,
-    size_t k,
-    mc_time_t *time
+    size_t below,
+    size_t lo_size,
+    uint8_t median
 ) {
-    assert(ch1);
-    assert(ch2);
-    assert(ch3);
-    assert(size > 0);
-    assert(k < size);
-
-    // Bound the values of pivots we can choose to ensure termination, since
-    // partition may not actually divide the array if, e.g., all the elements
-    // are the same.
-    uint8_t min_pivot = 0;
-    uint8_t max_pivot = (uint8_t) ~0u;
-
-    while ((size > 1) && (min_pivot <= max_pivot)) {
-        // Get our pivot. Random is "good enough" for O(n) in most cases.
-        size_t pivot_idx = ((size_t) (unsigned int) rand()) % size;
-        uint8_t pivot = ch1[pivot_idx];
-        assert(pivot >= min_pivot);
-        pivot = MIN(pivot, max_pivot);
-
-        // Partition across our pivot.
-        size_t mid;
-        MC_TIME(
-            time->part,
-            size,
-            mid = Partition(ws, ch1, ch2, ch3, size, pivot, time);
-        );
-        assert(mid <= size);
-
-        if (k < mid) {
-            size = mid;
-            max_pivot = pivot - 1;
-        } else if (k >= mid) {
-            assert(mid < size);
-            ch1 = &ch1[mid];
-            ch2 = &ch2[mid];
-            ch3 = &ch3[mid];
-            size -= mid;
-            k -= mid;
-            min_pivot = pivot + 1;
+    const __m256i v = _mm256_set1_epi8((char) median);
+    size_t i = 0, j = below, swaps = 0;
+    uint32_t i_mask = MPMatch(ch1, i, below, v, 0);
+    uint32_t j_mask = MPMatch(ch1, j, lo_size, v, ~0u);
+
+    for (;;) {
+        while (!i_mask) {
+            i += 32;
+            if (i >= below) {
+                return below + MIN(j + 32, lo_size) - below + 12 * swaps;
+            }
+            i_mask = MPMatch(ch1, i, below, v, 0);
+        }
+        while (!j_mask) {
+            j += 32;
+            assert(j < lo_size);
+            j_mask = MPMatch(ch1, j, lo_size, v, ~0u);
         }
-    }
 
-    return ch1[0];
+        size_t a = i + (size_t) __builtin_ctz(i_mask);
+        size_t b = j + (size_t) __builtin_ctz(j_mask);
+        SWAP(ch1[a], ch1[b]);
+        SWAP(ch2[a], ch2[b]);
+        SWAP(ch3[a], ch3[b]);
+        i_mask &= i_mask - 1;
+        j_mask &= j_mask - 1;
+        swaps++;
+    }
 }
 
 size_t
@@ -796,39 +1082,409 @@ MedianPartition(
     uint8_t *ch2,
     uint8_t *ch3,
     size_t size,
+    mp_bounds_t *bounds,
     mc_time_t *time
 ) {
-    // Use the quickselect algorithm to find the median.
+    assert(size > 0);
+
+    // Values are bytes, so one counting pass finds the exact median without
+    // moving anything.
+    uint32_t hist[256];
+    MC_TIME(
+        time->count,
+        size,
+        MPCount(hist, ch1, size);
+    );
+
     size_t mid = size >> 1;
-    uint8_t m1 = QSelect(ws, ch1, ch2, ch3, size, mid, time);
+    size_t below = 0;
+    unsigned int m = 0;
+    while (below + hist[m] <= mid) {
+        below += hist[m++];
+    }
+    uint8_t median = (uint8_t) m;
 
-    // Partition across the median.
+    // Partition across the median, finding the bounds of the elements on
+    // either side of it on the way.
+    MPBoundsInit(bounds);
     size_t lo_size;
     MC_TIME(
         time->part,
         size,
-        lo_size = Partition(ws, ch1, ch2, ch3, size, m1, time);
+        lo_size = Partition(ws, ch1, ch2, ch3, size, median, bounds, time);
     );
-    assert(lo_size > mid);
+    time->moved_bytes += 6 * size;
+    assert(lo_size == below + hist[m]);
+
+    // Bring the median values to the end of the low side, unless it holds
+    // nothing else or already ends right at the median. Swapping them with
+    // the lesser values is cheaper than partitioning it again while at most
+    // a fraction of the elements need to move.
+    if (below > 0 && lo_size > mid + 1) {
+        if (MIN(below, hist[m]) * MP_GATHER_RATIO <= lo_size) {
+            MC_TIME(
+                time->gather,
+                lo_size,
+                time->moved_bytes += GatherMedian(ch1, ch2, ch3, below, lo_size, median);
+            );
+        } else {
+            size_t tmp;
+            MC_TIME(
+                time->part,
+                lo_size,
+                tmp = Partition(ws, ch1, ch2, ch3, lo_size, median - 1, NULL, time);
+            );
+            time->moved_bytes += 6 * lo_size;
+            assert(tmp == below);
+        }
+        assert(ch1[mid] == median);
+    }
 
-    // Partition again across (median - 1) to force all median values to the
-    // middle of the array.
-    uint8_t median = m1;
-    if (median-- > 0) {
-        size_t tmp;
-        MC_TIME(
-            time->part,
-            lo_size,
-            tmp = Partition(ws, ch1, ch2, ch3, lo_size, median, time);
-        );
-        assert(tmp <= mid);
+    // The median values are now together in [below, lo_size), and split
+    // between the halves at mid, unless they were left where they were
+    // because they all go low.
+    size_t ties = (lo_size == mid + 1) ? 0 : below;
+    MC_TIME(
+        time->shrink,
+        lo_size - ties,
+        MPGrowRange(ch2, ch3, ties, mid + 1, bounds->lo_min, bounds->lo_max);
+        MPGrowRange(ch2, ch3, mid + 1, lo_size, bounds->hi_min, bounds->hi_max);
+    );
+
+    // The first channel is bounded by the lowest and highest values in its
+    // histogram, and by the median wherever it goes.
+    unsigned int first = 0, last = 255, next = m + 1;
+    while (hist[first] == 0) first++;
+    while (hist[last] == 0) last--;
+    while (next <= last && hist[next] == 0) next++;
+    bounds->lo_min[0] = (uint8_t) first;
+    bounds->lo_max[0] = median;
+    if (lo_size > mid + 1) {
+        bounds->hi_min[0] = median;
+        bounds->hi_max[0] = (uint8_t) last;
+    } else if (last > m) {
+        bounds->hi_min[0] = (uint8_t) next;
+        bounds->hi_max[0] = (uint8_t) last;
+    }
+
+    time->splits++;
+
+    return mid;
+}
+
+/**
+ * @brief Sends one element of each channel to either side of the partition,
+ *        and grows the bounds of that side. The low side fills forward from
+ *        lo_pos, the high side backward from hi_pos.
+ */
+static inline void
+MPScatterOne(
+    uint8_t *src[3],
+    uint8_t *dst[3],
+    size_t i,
+    bool lo,
+    size_t *lo_pos,
+    size_t *hi_pos,
+    mp_bounds_t *bounds
+) {
+    size_t pos = lo ? (*lo_pos)++ : --(*hi_pos);
+    uint8_t *min = lo ? bounds->lo_min : bounds->hi_min;
+    uint8_t *max = lo ? bounds->lo_max : bounds->hi_max;
+
+    for (size_t c = 0; c < 3; c++) {
+        uint8_t v = src[c][i];
+        dst[c][pos] = v;
+        min[c] = MIN(min[c], v);
+        max[c] = MAX(max[c], v);
+    }
+}
+
+/**
+ * @brief Stores the first n bytes of x to dst from pos on, as a single 8-byte
+ *        store if the spill stays below end.
+ */
+static inline void
+MPStoreRun(
+    uint8_t *dst,
+    size_t pos,
+    size_t end,
+    __m128i x,
+    size_t n
+) {
+    if (pos + 8 <= end) {
+        _mm_storel_epi64((__m128i*) &dst[pos], x);
+    } else {
+        uint8_t tmp[16];
+        _mm_storeu_si128((__m128i*) tmp, x);
+        memcpy(&dst[pos], tmp, n);
+    }
+}
+
+/**
+ * @brief Stores the last n of the first 8 bytes of x to dst just below pos,
+ *        as a single 8-byte store if the spill stays above begin.
+ */
+static inline void
+MPStoreRunDown(
+    uint8_t *dst,
+    size_t pos,
+    size_t begin,
+    __m128i x,
+    size_t n
+) {
+    if (pos >= begin + 8) {
+        _mm_storel_epi64((__m128i*) &dst[pos - 8], x);
+    } else {
+        uint8_t tmp[16];
+        _mm_storeu_si128((__m128i*) tmp, x);
+        memcpy(&dst[pos - n], &tmp[8 - n], n);
+    }
+}
+
+/**
+ * @brief Expands a 32-bit mask into a vector with one byte per bit, set to
+ *        0xFF where the bit is.
+ */
+static inline __m256i
+MPExpandMask(
+    uint32_t mask
+) {
+    const __m256i spread = _mm256_setr_epi8(
+        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+        2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3
+    );
+    const __m256i bits = _mm256_set1_epi64x((long long) 0x8040201008040201ull);
+    __m256i x = _mm256_shuffle_epi8(_mm256_set1_epi32((int) mask), spread);
+    return _mm256_cmpeq_epi8(_mm256_and_si256(x, bits), bits);
+}
+
+/**
+ * @brief Scatters one block of a median partition to its destinations.
+ *
+ * Elements above the median go high, elements below it go low, and the first
+ * blk->quota elements equal to it go low too. The block is split 32 elements
+ * at a time, as the quota allows, and a single sort1b_4x8 shuffle puts the
+ * low elements of each 8-element group first and the high ones last. The
+ * same 8 bytes are then stored forward at the low end and backward at the
+ * high end, each store spilling into space the next group overwrites, so no
+ * branch depends on how many elements go either way.
+ */
+static void
+MPScatterBlock(
+    mp_block_t *blk,
+    uint8_t *src[3],
+    uint8_t *dst[3],
+    size_t begin,
+    size_t end,
+    uint8_t median
+) {
+    size_t lo_pos = blk->lo_dst;
+    size_t hi_pos = blk->hi_end;
+    size_t quota = blk->quota;
+    mp_bounds_t *b = &blk->bounds;
+    MPBoundsInit(b);
+
+    const __m256i m = _mm256_set1_epi8((char) median);
+    const __m256i ones = _mm256_cmpeq_epi8(m, m);
+    __m256i lo_min[3], lo_max[3], hi_min[3], hi_max[3];
+    for (size_t c = 0; c < 3; c++) {
+        lo_min[c] = hi_min[c] = ones;
+        lo_max[c] = hi_max[c] = _mm256_setzero_si256();
+    }
+
+    size_t i = begin;
+    for (; i + 32 <= end; i += 32) {
+        __m256i v[3];
+        for (size_t c = 0; c < 3; c++) {
+            v[c] = _mm256_loadu_si256((__m256i*) &src[c][i]);
+        }
+
+        // Elements above the median, and those equal to it past the quota.
+        __m256i le = _mm256_cmpeq_epi8(_mm256_max_epu8(v[0], m), m);
+        uint32_t eq = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v[0], m));
+        uint32_t mask = ~(uint32_t) _mm256_movemask_epi8(le);
+        size_t n_eq = (size_t) __builtin_popcount(eq);
+        if (n_eq <= quota) {
+            quota -= n_eq;
+        } else {
+            for (; quota > 0; quota--) {
+                eq &= eq - 1;
+            }
+            mask |= eq;
+        }
+        __m256i hi = MPExpandMask(mask);
+
+        for (size_t c = 0; c < 3; c++) {
+            lo_min[c] = _mm256_min_epu8(lo_min[c], _mm256_or_si256(v[c], hi));
+            lo_max[c] = _mm256_max_epu8(lo_max[c], _mm256_andnot_si256(hi, v[c]));
+            hi_min[c] = _mm256_min_epu8(hi_min[c], _mm256_or_si256(_mm256_andnot_si256(hi, ones), v[c]));
+            hi_max[c] = _mm256_max_epu8(hi_max[c], _mm256_and_si256(hi, v[c]));
+        }
+
+        for (size_t g = 0; g < 32; g += 8) {
+            uint32_t m8 = (mask >> g) & 0xFF;
+            size_t n_hi = (size_t) __builtin_popcount(m8);
+            size_t n_lo = 8 - n_hi;
+            __m128i shuf = _mm_loadl_epi64((const __m128i*) sort1b_4x8[m8]);
+
+            for (size_t c = 0; c < 3; c++) {
+                __m128i x = _mm_loadl_epi64((const __m128i*) &src[c][i + g]);
+                x = _mm_shuffle_epi8(x, shuf);
+                MPStoreRun(dst[c], lo_pos, blk->lo_end, x, n_lo);
+                MPStoreRunDown(dst[c], hi_pos, blk->hi_dst, x, n_hi);
+            }
+            lo_pos += n_lo;
+            hi_pos -= n_hi;
+        }
+    }
+
+    MPReduceVectors(b->lo_min, b->lo_max, lo_min, lo_max, 3);
+    MPReduceVectors(b->hi_min, b->hi_max, hi_min, hi_max, 3);
+
+    for (; i < end; i++) {
+        uint8_t v = src[0][i];
+        bool lo = (v < median) || ((v == median) && (quota > 0));
+        if (v == median && quota > 0) quota--;
+        MPScatterOne(src, dst, i, lo, &lo_pos, &hi_pos, b);
+    }
+}
+
+size_t
+ScatterMedianPartition(
+    uint8_t *src[3],
+    uint8_t *dst[3],
+    size_t size,
+    mp_bounds_t *bounds,
+    mc_time_t *time
+) {
+    assert(size > 0);
+
+    mp_block_t blk;
+    MC_TIME(
+        time->count,
+        size,
+        MPCount(blk.hist, src[0], size);
+    );
+
+    size_t mid = size >> 1;
+    size_t below = 0;
+    unsigned int m = 0;
+    while (below + blk.hist[m] <= mid) {
+        below += blk.hist[m++];
     }
 
-    assert(ch1[mid] == m1);
+    blk.quota = mid + 1 - below;
+    blk.lo_dst = 0;
+    blk.lo_end = mid + 1;
+    blk.hi_dst = mid + 1;
+    blk.hi_end = size;
+
+    MC_TIME(
+        time->part,
+        size,
+        MPScatterBlock(&blk, src, dst, 0, size, (uint8_t) m);
+    );
+    *bounds = blk.bounds;
+    time->moved_bytes += 6 * size;
+    time->splits++;
 
     return mid;
 }
 
+size_t
+ParallelMedianPartition(
+    mp_parallel_t *ws,
+    uint8_t *src[3],
+    uint8_t *dst[3],
+    size_t size,
+    mc_time_t *time
+) {
+    assert(ws);
+    assert(size > 0);
+
+    const size_t blocks = (size + MP_BLOCK_SIZE - 1) / MP_BLOCK_SIZE;
+    unsigned long long ts1, ts2;
+    TIMESTAMP(ts1);
+
+    // Histogram of the first channel, by block.
+    #pragma omp for schedule(static)
+    for (size_t b = 0; b < blocks; b++) {
+        size_t begin = b * MP_BLOCK_SIZE;
+        MPCount(ws->blocks[b].hist, &src[0][begin], MIN(size - begin, MP_BLOCK_SIZE));
+    }
+
+    // Find the median, and where each block goes on either side of it.
+    #pragma omp single
+    {
+        size_t mid = size >> 1;
+        size_t below = 0, count;
+        unsigned int median = 0;
+        for (;; median++) {
+            count = 0;
+            for (size_t b = 0; b < blocks; b++) {
+                count += ws->blocks[b].hist[median];
+            }
+            if (below + count > mid) break;
+            below += count;
+        }
+
+        // Elements equal to the median fill the low half up to mid.
+        size_t quota = mid + 1 - below;
+        size_t lo_dst = 0, hi_dst = mid + 1;
+        for (size_t b = 0; b < blocks; b++) {
+            mp_block_t *blk = &ws->blocks[b];
+            size_t len = MIN(size, (b + 1) * MP_BLOCK_SIZE) - b * MP_BLOCK_SIZE;
+            size_t lo = 0;
+            for (unsigned int v = 0; v < median; v++) {
+                lo += blk->hist[v];
+            }
+            blk->quota = MIN(quota, blk->hist[median]);
+            quota -= blk->quota;
+            lo += blk->quota;
+
+            blk->lo_dst = lo_dst;
+            blk->hi_dst = hi_dst;
+            lo_dst += lo;
+            hi_dst += len - lo;
+            blk->lo_end = lo_dst;
+            blk->hi_end = hi_dst;
+        }
+        assert(lo_dst == mid + 1);
+
+        ws->median = (uint8_t) median;
+        ws->mid = mid;
+    }
+
+    #pragma omp for schedule(static)
+    for (size_t b = 0; b < blocks; b++) {
+        MPScatterBlock(&ws->blocks[b], src, dst, b * MP_BLOCK_SIZE,
+                       MIN(size, (b + 1) * MP_BLOCK_SIZE), ws->median);
+    }
+
+    #pragma omp single
+    {
+        mp_bounds_t *bounds = &ws->bounds;
+        MPBoundsInit(bounds);
+        for (size_t b = 0; b < blocks; b++) {
+            mp_bounds_t *blk = &ws->blocks[b].bounds;
+            for (size_t c = 0; c < 3; c++) {
+                bounds->lo_min[c] = MIN(bounds->lo_min[c], blk->lo_min[c]);
+                bounds->lo_max[c] = MAX(bounds->lo_max[c], blk->lo_max[c]);
+                bounds->hi_min[c] = MIN(bounds->hi_min[c], blk->hi_min[c]);
+                bounds->hi_max[c] = MAX(bounds->hi_max[c], blk->hi_max[c]);
+            }
+        }
+
+        TIMESTAMP(ts2);
+        time->mid_time += (ts2 - ts1);
+        time->mid_units += size;
+        time->moved_bytes += 6 * size;
+        time->splits++;
+    }
+
+    return ws->mid;
+}
+
 void
 MPWorkspaceInit(
     mp_workspace_t *ws,
@@ -846,3 +1502,21 @@ MPWorkspaceDestroy(
     assert(ws);
     XFree(ws->counts);
 }
+
+void
+MPParallelInit(
+    mp_parallel_t *ws,
+    size_t size
+) {
+    assert(ws);
+    assert(size > 0);
+    ws->blocks = XMalloc(((size + MP_BLOCK_SIZE - 1) / MP_BLOCK_SIZE) * sizeof(mp_block_t));
+}
+
+void
+MPParallelDestroy(
+    mp_parallel_t *ws
+) {
+    assert(ws);
+    XFree(ws->blocks);
+}
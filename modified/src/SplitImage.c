@@ -8,6 +8,7 @@
 #undef NDEBUG
 #include <assert.h>
 #include <stdint.h>
+#include <string.h>
 
 #include <SplitImage.h>
 
@@ -52,6 +53,21 @@ CreateSplitImage(
     unsigned long long ts1, ts2;
     TIMESTAMP(ts1);
 
+    /* A grey image only has one channel to copy. The quantizer still permutes
+     * three planes, so each gets its own copy. */
+    if (img->gray) {
+        size_t size = ret->w * ret->h;
+        memcpy(ret->r, img->gray, size);
+        memcpy(ret->g, img->gray, size);
+        memcpy(ret->b, img->gray, size);
+
+        TIMESTAMP(ts2);
+        time->mc_time += (ts2 - ts1);
+        time->split_time += (ts2 - ts1);
+        time->split_units += size;
+        return ret;
+    }
+
     register __m256i r, g, b, m1, m2, m3, rev1, rev3, tmp, mtmp;
     register __m256i rgb_gbr, brg_rgb, gbr_brg, smask;
     smask = _mm256_load_si256((__m256i*) shuffle_mask);
@@ -19,11 +19,67 @@ typedef struct {
     unsigned long long dither_units;
     unsigned long long deshift_time;
     unsigned long long deshift_units;
+    unsigned long long stall_time;
+    unsigned long long wave_time;
+    unsigned long long wave_units;
+    unsigned int threads;
 } dt_time_t;
 
+typedef enum {
+    DT_DIFFUSION_FLOYD_STEINBERG,
+    DT_DIFFUSION_JJN,
+    DT_DIFFUSION_STUCKI,
+    DT_DIFFUSION_SIERRA3,
+    DT_DIFFUSION_SIERRA2,
+    DT_DIFFUSION_SIERRA_LITE,
+    DT_DIFFUSION_ATKINSON
+} DTDiffusionMatrix;
+
 void DTTimeInit(dt_time_t *time);
 void DTTimeReport(dt_time_t *time);
 
-void ApplyFloydSteinbergDither(DTImage *image, DTPalettePacked *palette, palette_time_t *palette_time);
+/*
+ * With serpentine set, every other 16-row strip is scanned right to left.
+ */
+void ApplyFloydSteinbergDither(DTImage *image, DTPalettePacked *palette, int serpentine,
+                               palette_time_t *palette_time);
+/*
+ * Floyd-Steinberg on the single channel of a grey image (image->gray set),
+ * with a grey palette (PaletteEnableGray).
+ */
+void ApplyFloydSteinbergDitherGray(DTImage *image, DTPalettePacked *palette, int serpentine,
+                                   palette_time_t *palette_time);
+void ApplyFloydSteinbergDitherLowMemory(DTImage *image, DTPalettePacked *palette, int serpentine,
+                                        palette_time_t *palette_time);
+/*
+ * Approximate Floyd-Steinberg: tiles of tile_size x tile_size pixels are
+ * dithered independently, in parallel, each with a margin of context that is
+ * dithered and then discarded.
+ */
+void ApplyFloydSteinbergDitherTiled(DTImage *image, DTPalettePacked *palette, size_t tile_size, int serpentine,
+                                    palette_time_t *palette_time);
+/*
+ * Floyd-Steinberg with 8-bit saturated errors, 32 pixels per register. Only
+ * exact while errors stay within +-127, as with evenly spaced grey palettes.
+ */
+void ApplyFloydSteinbergDitherInt8(DTImage *image, DTPalettePacked *palette, palette_time_t *palette_time);
+void ApplyErrorDiffusionDither(DTImage *image, DTPalettePacked *palette, DTDiffusionMatrix matrix,
+                               int serpentine, palette_time_t *palette_time);
+/*
+ * Riemersma dithering along a Hilbert curve, restarted in every 32x32 tile.
+ */
+void ApplyRiemersmaDither(DTImage *image, DTPalettePacked *palette, palette_time_t *palette_time);
+/*
+ * Knuth's dot diffusion with an 8x8 class matrix, one class at a time.
+ */
+void ApplyDotDiffusionDither(DTImage *image, DTPalettePacked *palette, palette_time_t *palette_time);
+void ApplyOrderedDither(DTImage *image, DTPalettePacked *palette, size_t matrix_size, palette_time_t *palette_time);
+void ApplyBlueNoiseDither(DTImage *image, DTPalettePacked *palette, size_t mask_size, palette_time_t *palette_time);
+
+/*
+ * Ordered dithering through per-color mixing plans (Knoll/Yliluoma), for
+ * palettes too irregular for a plain threshold bias.
+ */
+void ApplyPatternDither(DTImage *image, DTPalettePacked *palette, palette_time_t *palette_time);
 
 #endif
@@ -31,17 +31,25 @@ typedef enum {
     t_UNKNOWN
 } DTImageType;
 
+/*
+ * Grey images may be held as a single channel instead: gray holds one byte
+ * per pixel and pixels is NULL. Exactly one of the two is set.
+ */
 typedef struct {
     size_t width;
     size_t height;
     DTImageType type;
     unsigned long resolution;
     DTPixel *pixels;
+    byte *gray;
 } DTImage;
 
 DTImage *CreateImageFromFile(char *filename);
 void WriteImageToFile(DTImage *img, char *filename);
 
+int ImageConvertToGray(DTImage *img);
+void ImageConvertToRGB(DTImage *img);
+
 DTPixel PixelFromRGB(byte r, byte g, byte b);
 
 #endif
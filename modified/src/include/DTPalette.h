@@ -10,6 +10,8 @@
 #define DT_PALETTE
 
 #include <stddef.h>
+#include <stdint.h>
+#include <immintrin.h>
 #include <DTImage.h>
 
 typedef struct {
@@ -17,22 +19,55 @@ typedef struct {
     DTPixel *colors;
 } DTPalette;
 
+/*
+ * Colors are stored planar (all r, then all g, then all b), each plane being
+ * stride entries long. The stride is size rounded up to the 16-entry search
+ * width, and the padding repeats the last color so it can never win a search.
+ *
+ * When cmap is non-NULL, searches go through a lazily filled inverse colormap
+ * (see PaletteEnableColormap). When gray is non-NULL, every color is a grey
+ * level and gray[v] holds the one closest to grey v (see PaletteEnableGray).
+ */
 typedef struct {
     size_t size;
+    size_t stride;
     int *colors;
+    uint16_t *cmap;
+    int *gray;
 } DTPalettePacked;
 
 typedef struct {
     unsigned long long search_time;
     unsigned long long search_units;
+    unsigned long long cmap_hits;
+    unsigned long long cmap_misses;
 } palette_time_t;
 
+DTPalettePacked *PaletteCreate(size_t size);
+void PalettePad(DTPalettePacked *palette);
+void PaletteEnableColormap(DTPalettePacked *palette);
+int PaletteEnableGray(DTPalettePacked *palette);
+void PaletteDestroy(DTPalettePacked *palette);
+
 DTPalettePacked *StandardPaletteBW(size_t size);
 DTPalettePacked *StandardPaletteRGB(void);
 
 DTPixel FindClosestColorFromPalette(DTPixel pixel, DTPalettePacked *palette, palette_time_t *time);
 
+/*
+ * Searches 16 pixels at once. rgb holds one vector of 16 int16 lanes per
+ * channel, each in [0, 255], and is replaced by the chosen colors.
+ */
+void FindClosestColorsFromPalette(__m256i *rgb, DTPalettePacked *palette, palette_time_t *time);
+
+/*
+ * Single-channel version for grey palettes: gray holds 16 int16 lanes in
+ * [0, 255]. Requires PaletteEnableGray.
+ */
+void FindClosestGraysFromPalette(__m256i *gray, DTPalettePacked *palette, palette_time_t *time);
+
 void PaletteTimeInit(palette_time_t *time);
+void PaletteTimeAdd(palette_time_t *dst, palette_time_t *src);
 void PaletteTimeReport(palette_time_t *time);
 
 #endif
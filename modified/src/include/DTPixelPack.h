@@ -0,0 +1,144 @@
+/*
+ *  DTPixelPack.h
+ *  dither Utility
+ *
+ *  Conversion between packed 24-bit pixels and 16 int16 lanes per channel,
+ *  shared by the vectorized dithering kernels.
+ *
+ */
+
+#ifndef DT_PIXEL_PACK
+#define DT_PIXEL_PACK
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <immintrin.h>
+#include <DTImage.h>
+#include <UtilMacro.h>
+
+/// @brief pshufb masks pulling one channel out of each 16-byte third of 16 packed pixels.
+__attribute__((aligned(16))) static const uint8_t deinterleave_rgb[3][3][16] = {
+    { { 0, 3, 6, 9, 12, 15, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128 },
+      { 128, 128, 128, 128, 128, 128, 2, 5, 8, 11, 14, 128, 128, 128, 128, 128 },
+      { 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 1, 4, 7, 10, 13 } },
+    { { 1, 4, 7, 10, 13, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128 },
+      { 128, 128, 128, 128, 128, 0, 3, 6, 9, 12, 15, 128, 128, 128, 128, 128 },
+      { 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 2, 5, 8, 11, 14 } },
+    { { 2, 5, 8, 11, 14, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128 },
+      { 128, 128, 128, 128, 128, 1, 4, 7, 10, 13, 128, 128, 128, 128, 128, 128 },
+      { 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 0, 3, 6, 9, 12, 15 } }
+};
+
+/// @brief pshufb masks placing each channel into each 16-byte third of 16 packed pixels.
+__attribute__((aligned(16))) static const uint8_t interleave_rgb[3][3][16] = {
+    { { 0, 128, 128, 1, 128, 128, 2, 128, 128, 3, 128, 128, 4, 128, 128, 5 },
+      { 128, 0, 128, 128, 1, 128, 128, 2, 128, 128, 3, 128, 128, 4, 128, 128 },
+      { 128, 128, 0, 128, 128, 1, 128, 128, 2, 128, 128, 3, 128, 128, 4, 128 } },
+    { { 128, 128, 6, 128, 128, 7, 128, 128, 8, 128, 128, 9, 128, 128, 10, 128 },
+      { 5, 128, 128, 6, 128, 128, 7, 128, 128, 8, 128, 128, 9, 128, 128, 10 },
+      { 128, 5, 128, 128, 6, 128, 128, 7, 128, 128, 8, 128, 128, 9, 128, 128 } },
+    { { 128, 11, 128, 128, 12, 128, 128, 13, 128, 128, 14, 128, 128, 15, 128, 128 },
+      { 128, 128, 11, 128, 128, 12, 128, 128, 13, 128, 128, 14, 128, 128, 15, 128 },
+      { 10, 128, 128, 11, 128, 128, 12, 128, 128, 13, 128, 128, 14, 128, 128, 15 } }
+};
+
+/**
+ * Loads 16 pixels of a row starting at column col (which may hang off either
+ * edge; those pixels read as zero) and widens each channel to int16.
+ */
+static inline void load_pixels16(const DTPixel *row, ptrdiff_t col, size_t width, __m256i rgb[3])
+{
+    DTPixel edge[16];
+    const DTPixel *src = &row[col];
+
+    if (col < 0 || col + 16 > (ptrdiff_t) width)
+    {
+        memset(edge, 0, sizeof(edge));
+        for (ptrdiff_t k = MAX(0, -col); k < 16 && col + k < (ptrdiff_t) width; k++)
+            edge[k] = row[col + k];
+        src = edge;
+    }
+
+    __m128i part[3];
+    for (size_t p = 0; p < 3; p++)
+        part[p] = _mm_loadu_si128((const __m128i*) ((const byte*) src + 16*p));
+
+    for (size_t c = 0; c < 3; c++)
+    {
+        __m128i ch = _mm_shuffle_epi8(part[0], _mm_load_si128((const __m128i*) deinterleave_rgb[c][0]));
+        ch = _mm_or_si128(ch, _mm_shuffle_epi8(part[1], _mm_load_si128((const __m128i*) deinterleave_rgb[c][1])));
+        ch = _mm_or_si128(ch, _mm_shuffle_epi8(part[2], _mm_load_si128((const __m128i*) deinterleave_rgb[c][2])));
+        rgb[c] = _mm256_cvtepu8_epi16(ch);
+    }
+}
+
+/**
+ * Clamps 16 int16 pixels per channel to [0, 255] and stores them packed into a
+ * row starting at column col; pixels hanging off either edge are dropped.
+ */
+static inline void store_pixels16(DTPixel *row, ptrdiff_t col, size_t width, __m256i rgb[3])
+{
+    __m128i ch[3];
+    for (size_t c = 0; c < 3; c++)
+    {
+        __m256i packed = _mm256_packus_epi16(rgb[c], _mm256_setzero_si256());
+        ch[c] = _mm256_castsi256_si128(_mm256_permute4x64_epi64(packed, 0xD8));
+    }
+
+    DTPixel edge[16];
+    const int full = col >= 0 && col + 16 <= (ptrdiff_t) width;
+    byte *dst = full ? (byte*) &row[col] : (byte*) edge;
+
+    for (size_t p = 0; p < 3; p++)
+    {
+        __m128i part = _mm_shuffle_epi8(ch[0], _mm_load_si128((const __m128i*) interleave_rgb[p][0]));
+        part = _mm_or_si128(part, _mm_shuffle_epi8(ch[1], _mm_load_si128((const __m128i*) interleave_rgb[p][1])));
+        part = _mm_or_si128(part, _mm_shuffle_epi8(ch[2], _mm_load_si128((const __m128i*) interleave_rgb[p][2])));
+        _mm_storeu_si128((__m128i*) (dst + 16*p), part);
+    }
+
+    if (!full)
+    {
+        for (ptrdiff_t k = MAX(0, -col); k < 16 && col + k < (ptrdiff_t) width; k++)
+            row[col + k] = edge[k];
+    }
+}
+
+/**
+ * Single-channel versions of the above, for grey rows of one byte per pixel.
+ */
+static inline __m256i load_gray16(const byte *row, ptrdiff_t col, size_t width)
+{
+    byte edge[16];
+    const byte *src = &row[col];
+
+    if (col < 0 || col + 16 > (ptrdiff_t) width)
+    {
+        memset(edge, 0, sizeof(edge));
+        for (ptrdiff_t k = MAX(0, -col); k < 16 && col + k < (ptrdiff_t) width; k++)
+            edge[k] = row[col + k];
+        src = edge;
+    }
+
+    return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*) src));
+}
+
+static inline void store_gray16(byte *row, ptrdiff_t col, size_t width, __m256i gray)
+{
+    __m256i packed = _mm256_packus_epi16(gray, _mm256_setzero_si256());
+    __m128i bytes = _mm256_castsi256_si128(_mm256_permute4x64_epi64(packed, 0xD8));
+
+    if (col >= 0 && col + 16 <= (ptrdiff_t) width)
+    {
+        _mm_storeu_si128((__m128i*) &row[col], bytes);
+        return;
+    }
+
+    byte edge[16];
+    _mm_storeu_si128((__m128i*) edge, bytes);
+    for (ptrdiff_t k = MAX(0, -col); k < 16 && col + k < (ptrdiff_t) width; k++)
+        row[col + k] = edge[k];
+}
+
+#endif
@@ -21,6 +21,31 @@ typedef unsigned int mc_uint_t;
 
 typedef struct mc_workspace_t MCWorkspace;
 
+/**
+ * Median-cut engines: the partition engine splits the pixels themselves in
+ * place, the scatter engine splits them out of place, back and forth between
+ * the image and a second set of planes, while the histogram engine splits the
+ * entries of a reduced color histogram, so only its first pass depends on the
+ * resolution. The sort engine splits entries too, one per distinct color,
+ * found by radix sorting the pixels.
+ */
+typedef enum {
+    MC_ENGINE_PARTITION,
+    MC_ENGINE_SCATTER,
+    MC_ENGINE_HISTOGRAM,
+    MC_ENGINE_SORT
+} mc_engine_t;
+
+/**
+ * Color each final cube stands for in the palette: the midpoint of its bounds,
+ * or the mean or per-channel median of its pixels.
+ */
+typedef enum {
+    MC_COLOR_MIDPOINT,
+    MC_COLOR_MEAN,
+    MC_COLOR_MEDIAN
+} mc_color_t;
+
 typedef struct mc_time {
     unsigned long long shrink_time;
     unsigned long long shrink_units;
@@ -38,6 +63,22 @@ typedef struct mc_time {
     unsigned long long split_units;
     unsigned long long full_time;
     unsigned long long full_units;
+    unsigned long long hist_time;
+    unsigned long long hist_units;
+    unsigned long long sort_time;
+    unsigned long long sort_units;
+    unsigned long long cut_time;
+    unsigned long long cut_units;
+    unsigned long long count_time;
+    unsigned long long count_units;
+    unsigned long long gather_time;
+    unsigned long long gather_units;
+    unsigned long long color_time;
+    unsigned long long color_units;
+    unsigned long long map_time;
+    unsigned long long map_units;
+    unsigned long long moved_bytes;
+    unsigned long long splits;
 } mc_time_t;
 
 /// @brief Times the given chunk of code to the given time structure.
@@ -51,9 +92,21 @@ do {\
     t##_units += u;\
 } while (0)
 
-MCWorkspace *MCWorkspaceMake(mc_byte_t level, size_t img_size);
+MCWorkspace *MCWorkspaceMake(mc_byte_t level, size_t img_size, mc_engine_t engine,
+                             mc_color_t color);
 void MCWorkspaceDestroy(MCWorkspace *ws);
 DTPalette *MCQuantizeData(SplitImage *img, MCWorkspace *ws, mc_time_t *time);
+DTPalette *MCQuantizeHistogram(DTImage *img, MCWorkspace *ws, mc_time_t *time);
+DTPalette *MCQuantizeSorted(SplitImage *img, MCWorkspace *ws, mc_time_t *time);
+
+/**
+ * After any of the above, writes for every pixel of the image the index of the
+ * cube its color falls in, by walking the splits of the median cut rather
+ * than searching the palette. Colors on the median of a split that were shared
+ * between both halves always go low. With the histogram engine, the splits
+ * were made over the mean colors of the histogram cells, not the pixels.
+ */
+void MCIndexMap(const MCWorkspace *ws, const DTImage *img, uint16_t *indices, mc_time_t *time);
 
 void MCTimeInit(mc_time_t *time);
 void MCTimeReport(mc_time_t *time);
@@ -32,6 +32,14 @@ void MPWorkspaceInit(mp_workspace_t *ws, size_t size);
  */
 void MPWorkspaceDestroy(mp_workspace_t *ws);
 
+/** @brief The min/max of each channel on either side of a median partition. */
+typedef struct {
+    uint8_t lo_min[3];
+    uint8_t lo_max[3];
+    uint8_t hi_min[3];
+    uint8_t hi_max[3];
+} mp_bounds_t;
+
 /**
  * @brief Partitions the first channel across its median, then arg-partitions
  *        the remaining two channels.
@@ -39,11 +47,79 @@ void MPWorkspaceDestroy(mp_workspace_t *ws);
  * @param ch2 The first channel to be arg-partitioned with ch1.
  * @param ch3 The second channel to be arg-partitioned with ch1.
  * @param size The size of the channels.
+ * @param bounds Returns the bounds of both halves, found while partitioning.
  * @param time The time tracking structure used to track time spent in the
  *             partition kernel.
  */
 size_t MedianPartition(mp_workspace_t *ws,
                        uint8_t *ch1, uint8_t *ch2, uint8_t *ch3, size_t size,
-                       mc_time_t *time);
+                       mp_bounds_t *bounds, mc_time_t *time);
+
+/** @brief Elements given to each thread by ParallelMedianPartition. */
+#define MP_BLOCK_SIZE ((size_t) 1 << 14)
+
+/** @brief Per-block state of ParallelMedianPartition. */
+typedef struct {
+    uint32_t hist[256];
+    size_t lo_dst;
+    size_t hi_dst;
+    size_t lo_end;
+    size_t hi_end;
+    size_t quota;
+    mp_bounds_t bounds;
+} mp_block_t;
+
+/** @brief Holds the data shared by the threads of ParallelMedianPartition. */
+typedef struct {
+    mp_block_t *blocks;
+    mp_bounds_t bounds;
+    uint8_t median;
+    size_t mid;
+} mp_parallel_t;
+
+/**
+ * @brief Initializes the given parallel MP workspace.
+ * @param ws The workspace to be initialized.
+ * @param size The maximum size of the arrays being partitioned.
+ */
+void MPParallelInit(mp_parallel_t *ws, size_t size);
+
+/**
+ * @brief Destroys the given parallel MP workspace.
+ */
+void MPParallelDestroy(mp_parallel_t *ws);
+
+/**
+ * @brief Partitions the channels across the median of the first, out of place
+ *        and with every thread of the current team.
+ *
+ * Must be reached by every thread of the team, like a worksharing construct.
+ * The median comes from a histogram of the first channel, and elements equal
+ * to it go low in the order they appear, so the result does not depend on the
+ * number of threads. The bounds of both halves are left in ws->bounds.
+ *
+ * @param src The channels to partition, the first one across its median.
+ * @param dst Where to write the partitioned channels.
+ * @param size The size of the channels.
+ * @return The index of the median, as in MedianPartition.
+ */
+size_t ParallelMedianPartition(mp_parallel_t *ws, uint8_t *src[3], uint8_t *dst[3],
+                               size_t size, mc_time_t *time);
+
+/**
+ * @brief Partitions the channels across the median of the first, out of place
+ *        and on the calling thread, as ParallelMedianPartition does.
+ *
+ * Every element is read and written once, with no data-dependent branch, at
+ * the cost of a second set of planes to write into.
+ *
+ * @param src The channels to partition, the first one across its median.
+ * @param dst Where to write the partitioned channels.
+ * @param size The size of the channels.
+ * @param bounds Returns the bounds of both halves.
+ * @return The index of the median, as in MedianPartition.
+ */
+size_t ScatterMedianPartition(uint8_t *src[3], uint8_t *dst[3], size_t size,
+                              mp_bounds_t *bounds, mc_time_t *time);
 
 #endif /* __MEDIAN_PARTITION_H__ */
@@ -21,9 +21,12 @@
 #include <XMalloc.h>
 #include <UtilMacro.h>
 
-DTPalettePacked *PaletteForIdentifier(char *s, DTImage *img);
+DTPalettePacked *PaletteForIdentifier(char *s, DTImage *img, mc_engine_t engine,
+                                      mc_color_t color, uint16_t **indices);
 DTPalettePacked *ReadPaletteFromStdin(size_t size);
-DTPalettePacked *QuantizedPaletteForImage(DTImage *image, size_t size);
+DTPalettePacked *QuantizedPaletteForImage(DTImage *image, size_t size, mc_engine_t engine,
+                                          mc_color_t color, uint16_t **indices);
+int DiffusionMatrixForName(const char *name, DTDiffusionMatrix *matrix);
 
 int
 main(int argc, char ** argv)
@@ -32,11 +35,24 @@ main(int argc, char ** argv)
     char *inputFile, *outputFile;
     int verbose = 0;
     int dither = 1;
+    int low_memory = 0;
+    int serpentine = 0;
+    int riemersma = 0;
+    int dot = 0;
+    int pattern = 0;
+    int narrow = 0;
+    int map = 0;
+    size_t bayer = 0;
+    size_t noise = 0;
+    size_t tile = 0;
+    DTDiffusionMatrix diffusion = DT_DIFFUSION_FLOYD_STEINBERG;
+    mc_engine_t engine = MC_ENGINE_PARTITION;
+    mc_color_t color = MC_COLOR_MIDPOINT;
     int c;
 
     opterr = 0;
 
-    while ((c = getopt(argc, argv, "dvp:")) != -1) {
+    while ((c = getopt(argc, argv, "8dklmrsvyp:b:c:n:e:q:t:")) != -1) {
         switch (c) {
             case 'p':
                 paletteID = optarg;
@@ -47,15 +63,102 @@ main(int argc, char ** argv)
             case 'd':
                 dither = 0;
                 break;
+            case 'l':
+                low_memory = 1;
+                break;
+            case 'm':
+                map = 1;
+                break;
+            case '8':
+                narrow = 1;
+                break;
+            case 'y':
+                pattern = 1;
+                break;
+            case 'k':
+                dot = 1;
+                break;
+            case 'r':
+                riemersma = 1;
+                break;
+            case 's':
+                serpentine = 1;
+                break;
+            case 'b':
+                bayer = strtoul(optarg, (char **)NULL, 10);
+                if (bayer != 2 && bayer != 4 && bayer != 8 && bayer != 16) {
+                    fprintf(stderr,
+                            "Invalid Bayer matrix size. Must be 2, 4, 8 or 16.\n");
+                    return 1;
+                }
+                break;
+            case 'n':
+                noise = strtoul(optarg, (char **)NULL, 10);
+                if (noise != 64 && noise != 128) {
+                    fprintf(stderr,
+                            "Invalid blue-noise mask size. Must be 64 or 128.\n");
+                    return 1;
+                }
+                break;
+            case 't':
+                tile = strtoul(optarg, (char **)NULL, 10);
+                if (tile < 16) {
+                    fprintf(stderr,
+                            "Invalid tile size. Must be at least 16.\n");
+                    return 1;
+                }
+                break;
+            case 'e':
+                if (DiffusionMatrixForName(optarg, &diffusion)) {
+                    fprintf(stderr, "Unrecognized diffusion matrix, aborting.\n");
+                    return 1;
+                }
+                break;
+            case 'q':
+                if (strcmp(optarg, "partition") == 0) {
+                    engine = MC_ENGINE_PARTITION;
+                } else if (strcmp(optarg, "scatter") == 0) {
+                    engine = MC_ENGINE_SCATTER;
+                } else if (strcmp(optarg, "histogram") == 0) {
+                    engine = MC_ENGINE_HISTOGRAM;
+                } else if (strcmp(optarg, "sort") == 0) {
+                    engine = MC_ENGINE_SORT;
+                } else {
+                    fprintf(stderr,
+                            "Unrecognized quantizer. Must be partition, scatter, histogram or sort.\n");
+                    return 1;
+                }
+                break;
+            case 'c':
+                if (strcmp(optarg, "midpoint") == 0) {
+                    color = MC_COLOR_MIDPOINT;
+                } else if (strcmp(optarg, "mean") == 0) {
+                    color = MC_COLOR_MEAN;
+                } else if (strcmp(optarg, "median") == 0) {
+                    color = MC_COLOR_MEDIAN;
+                } else {
+                    fprintf(stderr,
+                            "Unrecognized cube color. Must be midpoint, mean or median.\n");
+                    return 1;
+                }
+                break;
             case '?':
                 fprintf(stderr, "Ignoring unknown option: -%c\n", optopt);
         }
     }
 
+    /* the tiled, low-precision and low-memory modes are Floyd-Steinberg
+     * only, and would otherwise drop the chosen matrix */
+    if ((tile || narrow || low_memory) && diffusion != DT_DIFFUSION_FLOYD_STEINBERG) {
+        fprintf(stderr,
+                "Options -t, -8 and -l only support the fs diffusion matrix.\n");
+        return 1;
+    }
+
     /* check if there is still two arguments remaining, for i/o */
     if (argc - optind != 2) {
         fprintf(stderr,
-            "Usage: %s [-p palette[.size]] [-dv] input output\n", argv[0]);
+            "Usage: %s [-p palette[.size]] [-e matrix | -b size | -n size | -y | -r | -k] [-t size] [-q quantizer] [-c color] [-8dlmsv] input output\n", argv[0]);
         return 1;
     }
 
@@ -66,7 +169,11 @@ main(int argc, char ** argv)
     DTImage *input = CreateImageFromFile(inputFile);
     if (input == NULL) return 2;
 
-    DTPalettePacked *palette = PaletteForIdentifier(paletteID, input);
+    /* without dithering, auto palettes can tell which color every pixel got
+     * from the median cut itself */
+    uint16_t *indices = NULL;
+    DTPalettePacked *palette = PaletteForIdentifier(paletteID, input, engine, color,
+                                                    (map && !dither) ? &indices : NULL);
     if (palette == NULL) return 3;
 
     /* dump palette if verbose option was set */
@@ -74,14 +181,55 @@ main(int argc, char ** argv)
         for (size_t i = 0; i < palette->size; i++)
             printf("%d %d %d\n",
                 palette->colors[i],
-                palette->colors[palette->size+i],
-                palette->colors[palette->size*2+i]
+                palette->colors[palette->stride+i],
+                palette->colors[palette->stride*2+i]
             );
 
+    /* grey images (or colour ones that turn out to be grey) mapped to a grey
+     * palette only need one channel, when dithered with plain Floyd-Steinberg
+     * or not at all; every other method works on packed RGB */
+    int plain = !noise && !pattern && !bayer && !dot && !riemersma && !tile &&
+                !narrow && !low_memory && diffusion == DT_DIFFUSION_FLOYD_STEINBERG;
+    int gray = !indices && (!dither || plain) && PaletteEnableGray(palette) &&
+               ImageConvertToGray(input);
+    if (!gray)
+        ImageConvertToRGB(input);
+
     palette_time_t palette_time;
     PaletteTimeInit(&palette_time);
-    if (dither) {
-        ApplyFloydSteinbergDither(input, palette, &palette_time);
+    if (dither && gray) {
+        ApplyFloydSteinbergDitherGray(input, palette, serpentine, &palette_time);
+    } else if (dither && noise) {
+        ApplyBlueNoiseDither(input, palette, noise, &palette_time);
+    } else if (dither && pattern) {
+        ApplyPatternDither(input, palette, &palette_time);
+    } else if (dither && bayer) {
+        ApplyOrderedDither(input, palette, bayer, &palette_time);
+    } else if (dither && dot) {
+        ApplyDotDiffusionDither(input, palette, &palette_time);
+    } else if (dither && riemersma) {
+        ApplyRiemersmaDither(input, palette, &palette_time);
+    } else if (dither && tile) {
+        ApplyFloydSteinbergDitherTiled(input, palette, tile, serpentine, &palette_time);
+    } else if (dither && narrow) {
+        ApplyFloydSteinbergDitherInt8(input, palette, &palette_time);
+    } else if (dither && low_memory) {
+        ApplyFloydSteinbergDitherLowMemory(input, palette, serpentine, &palette_time);
+    } else if (dither) {
+        ApplyErrorDiffusionDither(input, palette, diffusion, serpentine, &palette_time);
+    } else if (indices) {
+        /* color of the cube each pixel fell in */
+        for (size_t i = 0; i < input->resolution; i++) {
+            input->pixels[i] = PixelFromRGB(
+                (byte) palette->colors[indices[i]],
+                (byte) palette->colors[palette->stride+indices[i]],
+                (byte) palette->colors[palette->stride*2+indices[i]]);
+        }
+        XFree(indices);
+    } else if (gray) {
+        /* closest grey only */
+        for (size_t i = 0; i < input->resolution; i++)
+            input->gray[i] = (byte) palette->gray[input->gray[i]];
     } else {
         /* closest color only */
         DTPixel *pixel;
@@ -96,14 +244,14 @@ main(int argc, char ** argv)
 
     WriteImageToFile(input, outputFile);
 
-    XFree(palette->colors);
-    XFree(palette);
+    PaletteDestroy(palette);
 
     return 0;
 }
 
 DTPalettePacked *
-PaletteForIdentifier(char *str, DTImage *image)
+PaletteForIdentifier(char *str, DTImage *image, mc_engine_t engine, mc_color_t color,
+                     uint16_t **indices)
 {
     // if (str == NULL) return StandardPaletteRGB();
 
@@ -156,7 +304,13 @@ PaletteForIdentifier(char *str, DTImage *image)
             fprintf(stderr, "Size must be a power of 16, aborting.\n");
             return NULL;
         }
-        return QuantizedPaletteForImage(image, size);
+        /* generated palettes are used once, so the colormap is filled
+         * lazily by the pixels that actually need it; small palettes are
+         * faster to search directly, 16 pixels at a time */
+        DTPalettePacked *palette = QuantizedPaletteForImage(image, size, engine, color, indices);
+        if (size > 16)
+            PaletteEnableColormap(palette);
+        return palette;
     }
 
     /* unknown palette */
@@ -167,49 +321,88 @@ PaletteForIdentifier(char *str, DTImage *image)
 DTPalettePacked *
 ReadPaletteFromStdin(size_t size)
 {
-    DTPalettePacked *palette = XMalloc(sizeof(DTPalettePacked));
-    palette->size = size;
-    palette->colors = XMalloc(size*sizeof(int)*3);
+    DTPalettePacked *palette = PaletteCreate(size);
 
     unsigned int r, g, b;
     for (size_t i = 0; i < size; i++) {
         assert(scanf(" %d %d %d", &r, &g, &b) == 3);
         palette->colors[i] = (byte) r;
-        palette->colors[palette->size+i] = (byte) g;
-        palette->colors[palette->size*2+i] = (byte) b;
+        palette->colors[palette->stride+i] = (byte) g;
+        palette->colors[palette->stride*2+i] = (byte) b;
     }
+    PalettePad(palette);
 
     return palette;
 }
 
 DTPalettePacked *
-QuantizedPaletteForImage(DTImage *image, size_t size)
+QuantizedPaletteForImage(DTImage *image, size_t size, mc_engine_t engine, mc_color_t color,
+                         uint16_t **indices)
 {
-    MCWorkspace *ws = MCWorkspaceMake((mc_byte_t) (double) log2(size), image->width * image->height);
-    DTPalettePacked *palette = XMalloc(sizeof(DTPalettePacked));
-
-    palette->colors = XMalloc(size*sizeof(int)*3);
-    palette->size = size;
+    MCWorkspace *ws = MCWorkspaceMake((mc_byte_t) (double) log2(size), image->width * image->height,
+                                      engine, color);
+    DTPalettePacked *palette = PaletteCreate(size);
     printf("Image size: (w, h) = (%zu, %zu)\n", image->width, image->height);
 
     mc_time_t mc_time;
     MCTimeInit(&mc_time);
-    SplitImage *img = CreateSplitImage(image, &mc_time);
-    DTPalette *mc = MCQuantizeData(img, ws, &mc_time);
+    /* the histogram engine reads the packed image directly */
+    SplitImage *img = NULL;
+    DTPalette *mc;
+    if (engine == MC_ENGINE_HISTOGRAM) {
+        mc = MCQuantizeHistogram(image, ws, &mc_time);
+    } else if (engine == MC_ENGINE_SORT) {
+        img = CreateSplitImage(image, &mc_time);
+        mc = MCQuantizeSorted(img, ws, &mc_time);
+    } else {
+        img = CreateSplitImage(image, &mc_time);
+        mc = MCQuantizeData(img, ws, &mc_time);
+    }
+    if (indices) {
+        *indices = XMalloc(image->resolution * sizeof(uint16_t));
+        MCIndexMap(ws, image, *indices, &mc_time);
+    }
     MCTimeReport(&mc_time);
 
     for (size_t i = 0; i < palette->size; i++) {
         palette->colors[i] = mc->colors[i].r;
-        palette->colors[palette->size+i] = mc->colors[i].g;
-        palette->colors[palette->size*2+i] = mc->colors[i].b;
+        palette->colors[palette->stride+i] = mc->colors[i].g;
+        palette->colors[palette->stride*2+i] = mc->colors[i].b;
     }
+    PalettePad(palette);
 
     MCWorkspaceDestroy(ws);
-    DestroySplitImage(img);
+    if (img) DestroySplitImage(img);
     XFree(mc->colors);
     XFree(mc);
 
     return palette;
 }
 
+int
+DiffusionMatrixForName(const char *name, DTDiffusionMatrix *matrix)
+{
+    static const struct {
+        const char *name;
+        DTDiffusionMatrix matrix;
+    } names[] = {
+        { "fs", DT_DIFFUSION_FLOYD_STEINBERG },
+        { "jjn", DT_DIFFUSION_JJN },
+        { "stucki", DT_DIFFUSION_STUCKI },
+        { "sierra3", DT_DIFFUSION_SIERRA3 },
+        { "sierra2", DT_DIFFUSION_SIERRA2 },
+        { "sierra-lite", DT_DIFFUSION_SIERRA_LITE },
+        { "atkinson", DT_DIFFUSION_ATKINSON },
+    };
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(name, names[i].name) == 0) {
+            *matrix = names[i].matrix;
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
 /* vim:set ts=8 sts=4 sw=4 */